@@ -14,6 +14,8 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 #include <stdint.h>
 #include <cstring>
 #include <cstdio>
@@ -23,8 +25,12 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
 #include "app.h"
 #include "numlock.h"
+#include "launcher.h"
+#include "authworker.h"
 #include "util.h"
 
 
@@ -34,9 +40,54 @@
 
 using namespace std;
 
+extern App* LoginApp;
+
+// Milliseconds since the system booted
+static long BootTimeMs() {
+    struct timespec ts;
+#ifdef CLOCK_BOOTTIME
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
 #ifdef USE_PAM
 #include <string>
+#include <exception>
+
+// Prompts of the PAM conversation, run by the UI thread
+static void PromptName(void* panel) {
+    Panel* p = static_cast<Panel*>(panel);
+    p->EventHandler(Panel::Get_Name);
+    if (p->getAction() == Panel::Login)
+        LoginApp->PrefetchUser(p->GetName());
+}
+
+static void PromptPasswd(void* panel) {
+    static_cast<Panel*>(panel)->EventHandler(Panel::Get_Passwd);
+}
+
+// pam_authenticate() as an AuthWorker task, passing its exception back
+struct Authentication {
+    PAM::Authenticator* pam;
+    std::exception_ptr error;
+};
+
+static void Authenticate(void* data) {
+    Authentication* auth = static_cast<Authentication*>(data);
+    try{
+        auth->pam->authenticate();
+    }
+    catch(...){
+        auth->error = std::current_exception();
+    }
+}
 
+/* PAM conversation. During authentication it runs on the AuthWorker
+ * thread, so everything touching the panel goes through AuthWorker::Call().
+ */
 int conv(int num_msg, const struct pam_message **msg,
          struct pam_response **resp, void *appdata_ptr){
     *resp = (struct pam_response *) calloc(num_msg, sizeof(struct pam_response));
@@ -48,7 +99,7 @@ int conv(int num_msg, const struct pam_message **msg,
         switch(msg[i]->msg_style){
             case PAM_PROMPT_ECHO_ON:
                 // We assume PAM is asking for the username
-                panel->EventHandler(Panel::Get_Name);
+                AuthWorker::Call(PromptName, panel);
                 switch(panel->getAction()){
                     case Panel::Suspend:
                     case Panel::Halt:
@@ -76,7 +127,7 @@ int conv(int num_msg, const struct pam_message **msg,
                         break;
 
                     default:
-                        panel->EventHandler(Panel::Get_Passwd);
+                        AuthWorker::Call(PromptPasswd, panel);
                         (*resp)[i].resp=strdup(panel->GetPasswd().c_str());
                         break;
                 }
@@ -104,8 +155,6 @@ int conv(int num_msg, const struct pam_message **msg,
 }
 #endif
 
-extern App* LoginApp;
-
 int xioerror(Display *disp) {
     LoginApp->RestartServer();
     return 0;
@@ -125,6 +174,29 @@ void User1Signal(int sig) {
     signal(sig, User1Signal);
 }
 
+// Match the theme fonts while the X server is starting up
+static void* MatchFontsThread(void* names) {
+    Panel::MatchFonts(*static_cast<vector<string>*>(names));
+    return NULL;
+}
+
+// Round trips to the X server until the greeter shows up
+static unsigned long round_trips = 0;
+static unsigned long round_trip_seen = 0;
+
+/* Xlib after-function, called once a request is done with. A request
+ * which waited for its reply leaves every request up to it processed by
+ * the server, this is how a round trip is told from a queued request.
+ * Requests sent straight through XCB are not seen.
+ */
+static int CountRoundTrip(Display* dpy) {
+    unsigned long processed = LastKnownRequestProcessed(dpy);
+    if (processed != round_trip_seen && processed == NextRequest(dpy) - 1)
+        round_trips++;
+    round_trip_seen = processed;
+    return 0;
+}
+
 
 App::App(int argc, char** argv)
   :
@@ -260,6 +332,15 @@ void App::Run() {
         }
     }
 
+    // Automatic login goes straight to the session: no fonts or images
+    // are touched unless the greeter is shown once the session ends
+    bool autologin = cfg->getOption("auto_login") == "yes"
+                     && cfg->getOption("default_user") != "";
+
+    vector<string> fontnames = Panel::FontNames(cfg);
+    pthread_t fontthread;
+    bool fontmatching = false;
+
     if (!testing) {
         // Create lock file
         LoginApp->GetLock();
@@ -292,6 +373,12 @@ void App::Run() {
         if (daemonmode)
             UpdatePid();
 
+        // fontconfig needs no display: get its slow first match done
+        // in the time the server takes to come up
+        if (!autologin)
+            fontmatching = (pthread_create(&fontthread, NULL, MatchFontsThread,
+                                           &fontnames) == 0);
+
         CreateServerAuth();
         StartServer();
 
@@ -300,10 +387,7 @@ void App::Run() {
         if (cfg->getOption("xsetup_script") != "") {
             const char* xsetup_cmd = cfg->getOption("xsetup_script").c_str();
             logStream << APPNAME << ": executing xsetup script '" << xsetup_cmd << "'" << endl;
-            char *tmp = new char[strlen(xsetup_cmd) + 60];
-            sprintf(tmp, xsetup_cmd);
-            system(tmp);
-            delete [] tmp;
+            Launcher::Run(xsetup_cmd);
             logStream << APPNAME << ": xsetup script '" << xsetup_cmd << "' finished." << endl;
         }
 
@@ -318,14 +402,14 @@ void App::Run() {
         if (!testing) StopServer();
         exit(ERR_EXIT);
     }
+    round_trips = 0;
+    round_trip_seen = 0;
+    XSetAfterFunction(Dpy, CountRoundTrip);
 
     // Get screen and root window
     Scr = DefaultScreen(Dpy);
     Root = RootWindow(Dpy, Scr);
 
-    // Intern _XROOTPMAP_ID property
-    BackgroundPixmapId = XInternAtom(Dpy, "_XROOTPMAP_ID", False);
-
     // for tests we use a standard window
     if (testing) {
         Window RealRoot = RootWindow(Dpy, Scr);
@@ -338,11 +422,16 @@ void App::Run() {
 
     HideCursor();
 
+    background = new Background(Dpy, Scr, Root, cfg);
+
+    if (fontmatching)
+        pthread_join(fontthread, NULL);
+
     // Create panel
     LoginPanel = new Panel(Dpy, Scr, Root, cfg, themedir, Panel::Mode_DM);
+    LoginPanel->SetBackground(background);
     bool firstloop = true; // 1st time panel is shown (for automatic username)
     bool focuspass = cfg->getOption("focus_password")=="yes";
-    bool autologin = cfg->getOption("auto_login")=="yes";
 
     if (firstlogin && cfg->getOption("default_user") != "") {
         LoginPanel->SetName(cfg->getOption("default_user") );
@@ -351,6 +440,8 @@ void App::Run() {
     #endif
         firstlogin = false;
         if (autologin) {
+            // the greeter isn't what we are waiting for here
+            XSetAfterFunction(Dpy, NULL);
             Login();
         }
     }
@@ -380,6 +471,11 @@ void App::Run() {
 
             // Show panel
             LoginPanel->OpenPanel();
+            // not counting any more after an autologin
+            if (firstloop && XSetAfterFunction(Dpy, NULL) == CountRoundTrip) {
+                logStream << APPNAME << ": greeter shown after "
+                          << round_trips << " X round trips" << endl;
+            }
         }
 
         LoginPanel->Reset();
@@ -387,12 +483,14 @@ void App::Run() {
 
         if (firstloop && cfg->getOption("default_user") != "") {
             LoginPanel->SetName(cfg->getOption("default_user") );
+            PrefetchUser(cfg->getOption("default_user"));
         }
 
 
         if (!AuthenticateUser(focuspass && firstloop)){
             panelclosed = 0;
             firstloop = false;
+            prefetch.Discard();
             LoginPanel->ClearPanel();
             XBell(Dpy, 100);
             continue;
@@ -411,6 +509,7 @@ void App::Run() {
         switch(Action) {
             case Panel::Login:
                 Login();
+                prefetch.Discard();
                 break;
             case Panel::Console:
                 Console();
@@ -437,7 +536,14 @@ bool App::AuthenticateUser(bool focuspass){
     try{
         if (!focuspass)
             pam.set_item(PAM::Authenticator::User, 0);
-        pam.authenticate();
+
+        // Authenticate on a worker thread, the panel stays responsive
+        Authentication auth;
+        auth.pam = &pam;
+        AuthWorker worker(LoginPanel);
+        worker.Run(Authenticate, &auth);
+        if (auth.error)
+            std::rethrow_exception(auth.error);
     }
     catch(PAM::Auth_Exception& e){
         switch(LoginPanel->getAction()){
@@ -465,6 +571,9 @@ bool App::AuthenticateUser(bool focuspass){
             case Panel::Console:
                 logStream << APPNAME << ": Got a special command (" << LoginPanel->GetName() << ")" << endl;
                 return true; // <--- This is simply fake!
+            case Panel::Login:
+                PrefetchUser(LoginPanel->GetName());
+                break;
             default:
                 break;
         }
@@ -482,9 +591,13 @@ bool App::AuthenticateUser(bool focuspass){
             break;
         case Panel::Console:
         case Panel::Exit:
-        case Panel::Login:
             pw = getpwnam(LoginPanel->GetName().c_str());
             break;
+        case Panel::Login:
+            pw = prefetch.Get(LoginPanel->GetName());
+            if (!pw)
+                pw = getpwnam(LoginPanel->GetName().c_str());
+            break;
     }
     endpwent();
     if(pw == 0)
@@ -508,6 +621,15 @@ bool App::AuthenticateUser(bool focuspass){
 #endif
 
 
+/* The user name is known: look the user up and warm the files the
+ * session will need while the password is typed. Login() takes the
+ * result, a failed attempt discards it.
+ */
+void App::PrefetchUser(const string& name) {
+    prefetch.Start(name, LoginPanel->getSession(),
+                   cfg->getOption("default_path"));
+}
+
 int App::GetServerPID() {
     return ServerPID;
 }
@@ -533,26 +655,80 @@ void App::Login() {
     struct passwd *pw;
     pid_t pid;
 
+    /* Find the user before PAM opens the session, so the Xauthority
+     * is written while the session modules run.
+     */
+#ifdef USE_PAM
+    string user;
+    try{
+        const char* name = static_cast<const char*>(pam.get_item(PAM::Authenticator::User));
+        if (name)
+            user = name;
+    }
+    catch(PAM::Exception& e){
+        logStream << APPNAME << ": " << e << endl;
+        exit(ERR_EXIT);
+    };
+#else
+    string user = LoginPanel->GetName();
+#endif
+    pw = prefetch.Get(user);
+    bool prefetched = (pw != NULL);
+    if (!pw)
+        pw = getpwnam(user.c_str());
+    endpwent();
+    if(pw == 0)
+        return;
+
+    // Write the user's Xauthority from a child of its own, while we
+    // set the session up with PAM and ConsoleKit below. Not while a
+    // lookup thread is inside NSS: the child could hang on its locks in
+    // initgroups(), the session process writes the file then.
+    struct stat home;
+    bool hadhome = (stat(pw->pw_dir, &home) == 0);
+    pid_t authpid = -1;
+    if (UserPrefetch::Idle())
+        authpid = fork();
+    if (authpid == 0) {
+        SwitchUser Su(pw, cfg, DisplayName, NULL);
+        _exit(Su.WriteClientAuth(mcookie.c_str()) ? OK_EXIT : ERR_EXIT);
+    }
+
 #ifdef USE_PAM
     try{
         pam.open_session();
-        pw = getpwnam(static_cast<const char*>(pam.get_item(PAM::Authenticator::User)));
     }
     catch(PAM::Cred_Exception& e){
         // Credentials couldn't be established
         logStream << APPNAME << ": " << e << endl;
+        Launcher::WaitFor(authpid, HELPER_TIMEOUT);
         return;
     }
     catch(PAM::Exception& e){
         logStream << APPNAME << ": " << e << endl;
         exit(ERR_EXIT);
     };
-#else
-    pw = getpwnam(LoginPanel->GetName().c_str());
+
+    // getpwnam()'s entry may have been overwritten by the session modules
+    if (!prefetched) {
+        pw = getpwnam(user.c_str());
+        endpwent();
+        if(pw == 0) {
+            Launcher::WaitFor(authpid, HELPER_TIMEOUT);
+            return;
+        }
+    }
 #endif
-    endpwent();
-    if(pw == 0)
-        return;
+
+    /* The session modules may have created the home directory
+     * (pam_mkhomedir) or mounted another one over it (pam_mount): then
+     * the file written above is not the one the session sees.
+     */
+    struct stat nowhome;
+    bool samehome = hadhome && stat(pw->pw_dir, &nowhome) == 0
+                    && nowhome.st_dev == home.st_dev
+                    && nowhome.st_ino == home.st_ino;
+
     if (pw->pw_shell[0] == '\0') {
         setusershell();
         strcpy(pw->pw_shell, getusershell());
@@ -600,6 +776,17 @@ void App::Login() {
     }
 #endif
 
+    // Nothing is drawn while the session runs: drop the decoded images
+    // and fonts, the panel reloads them if it is shown again
+    LoginPanel->FreeResources();
+    background->FreeResources();
+
+    // If writing the Xauthority failed, hung or went to a home that
+    // changed under it, the session process writes it again
+    bool authwritten = Launcher::WaitFor(authpid, HELPER_TIMEOUT) == OK_EXIT
+                       && samehome;
+    bool startasync = cfg->getOption("sessionstart_async") == "yes";
+
     // Create new process
     pid = fork();
     if(pid == 0) {
@@ -659,14 +846,32 @@ void App::Login() {
         replaceVariables(loginCommand, SESSION_VAR, session);
         replaceVariables(loginCommand, THEME_VAR, themeName);
         string sessStart = cfg->getOption("sessionstart_cmd");
-        if (sessStart != "") {
+        if (sessStart != "" && !startasync) {
             replaceVariables(sessStart, USER_VAR, pw->pw_name);
-            system(sessStart.c_str());
+            Launcher::Run(sessStart);
         }
-        Su.Login(loginCommand.c_str(), mcookie.c_str());
+        uint64_t submitted = LoginPanel->GetSubmitTime();
+        if (submitted)
+            logStream << APPNAME << ": starting session "
+                      << Panel::CurrentEpochms() - submitted
+                      << " ms after Enter" << endl;
+        else
+            logStream << APPNAME << ": starting session "
+                      << BootTimeMs() << " ms after boot" << endl;
+        Su.Login(loginCommand.c_str(), authwritten ? NULL : mcookie.c_str());
         _exit(OK_EXIT);
     }
 
+    // An async sessionstart_cmd runs alongside the session start-up
+    pid_t startpid = -1;
+    if (startasync && pid > 0) {
+        string sessStart = cfg->getOption("sessionstart_cmd");
+        if (sessStart != "") {
+            replaceVariables(sessStart, USER_VAR, pw->pw_name);
+            startpid = Launcher::Spawn(sessStart);
+        }
+    }
+
 #ifndef XNEST_DEBUG
     CloseLog();
 #endif
@@ -678,6 +883,15 @@ void App::Login() {
         wpid = wait(&status);
         if (wpid == ServerPID)
             xioerror(Dpy);	// Server died, simulate IO error
+        if (wpid == startpid)
+            startpid = -1;
+    }
+
+    // A sessionstart_cmd outliving the session is stopped and reaped
+    // here, not left as a zombie
+    if (startpid > 0 && waitpid(startpid, NULL, WNOHANG) == 0) {
+        kill(startpid, SIGTERM);
+        Launcher::WaitFor(startpid, HELPER_TIMEOUT);
     }
     if (WIFEXITED(status) && WEXITSTATUS(status)) {
         LoginPanel->Message("Failed to execute login command");
@@ -686,7 +900,7 @@ void App::Login() {
          string sessStop = cfg->getOption("sessionstop_cmd");
          if (sessStop != "") {
             replaceVariables(sessStop, USER_VAR, pw->pw_name);
-            system(sessStop.c_str());
+            Launcher::Run(sessStop);
         }
     }
 
@@ -750,7 +964,7 @@ void App::Reboot() {
     // Stop server and reboot
     StopServer();
     RemoveLock();
-    system(cfg->getOption("reboot_cmd").c_str());
+    Launcher::Run(cfg->getOption("reboot_cmd"));
     exit(OK_EXIT);
 }
 
@@ -772,13 +986,13 @@ void App::Halt() {
     // Stop server and halt
     StopServer();
     RemoveLock();
-    system(cfg->getOption("halt_cmd").c_str());
+    Launcher::Run(cfg->getOption("halt_cmd"));
     exit(OK_EXIT);
 }
 
 void App::Suspend() {
     sleep(1);
-    system(cfg->getOption("suspend_cmd").c_str());
+    Launcher::Run(cfg->getOption("suspend_cmd"));
 }
 
 
@@ -794,7 +1008,7 @@ void App::Console() {
     const char* cmd = cfg->getOption("console_cmd").c_str();
     char *tmp = new char[strlen(cmd) + 60];
     sprintf(tmp, cmd, width, height, posx, posy, fontx, fonty);
-    system(tmp);
+    Launcher::Run(tmp);
     delete [] tmp;
 }
 
@@ -816,9 +1030,12 @@ void App::Exit() {
 		LoginPanel->Message(testmsg);
         sleep(3);
         delete LoginPanel;
+        delete background;
+        Image::forgetDisplay(Dpy);
         XCloseDisplay(Dpy);
     } else {
         delete LoginPanel;
+        delete background;
         StopServer();
         RemoveLock();
     }
@@ -852,32 +1069,113 @@ void App::RestartServer() {
     }
 }
 
-void App::KillAllClients(Bool top) {
-    Window dummywindow;
-    Window *children;
-    unsigned int nchildren;
-    unsigned int i;
-    XWindowAttributes attr;
+/* The client windows of the viewable windows among windows, as
+ * XmuClientWindow() finds them: the window itself or the first
+ * descendant with WM_STATE, else the window itself. Instead of a few
+ * round trips per window, the requests for all windows are sent before
+ * any reply is read, one depth of the window trees at a time. Errors go
+ * to the Xlib error handler.
+ */
+static vector<xcb_window_t> ClientWindows(xcb_connection_t* conn,
+                                          const xcb_window_t* windows,
+                                          int count) {
+    const char* name = "WM_STATE";
+    xcb_intern_atom_cookie_t atom_cookie =
+        xcb_intern_atom(conn, 1, strlen(name), name);
+    vector<xcb_get_window_attributes_cookie_t> attr_cookies(count);
+    for (int i = 0; i < count; i++)
+        attr_cookies[i] = xcb_get_window_attributes(conn, windows[i]);
+
+    xcb_atom_t wm_state = XCB_NONE;
+    xcb_intern_atom_reply_t* atom =
+        xcb_intern_atom_reply(conn, atom_cookie, NULL);
+    if (atom) {
+        wm_state = atom->atom;
+        free(atom);
+    }
 
-    XSync(Dpy, 0);
-    XSetErrorHandler(CatchErrors);
+    vector<xcb_window_t> clients;
+    for (int i = 0; i < count; i++) {
+        xcb_get_window_attributes_reply_t* attr =
+            xcb_get_window_attributes_reply(conn, attr_cookies[i], NULL);
+        if (attr && attr->map_state == XCB_MAP_STATE_VIEWABLE)
+            clients.push_back(windows[i]);
+        free(attr);
+    }
+    if (wm_state == XCB_NONE)
+        return clients;
+
+    // The windows to look at next, with the top-level window they are under
+    vector<pair<xcb_window_t, size_t> > level;
+    for (size_t i = 0; i < clients.size(); i++)
+        level.push_back(make_pair(clients[i], i));
+    vector<bool> found(clients.size(), false);
+
+    while (!level.empty()) {
+        // Ask for WM_STATE and for the children in the same go, the
+        // children are only needed if none of this depth has WM_STATE
+        vector<xcb_get_property_cookie_t> props(level.size());
+        vector<xcb_query_tree_cookie_t> trees(level.size());
+        for (size_t i = 0; i < level.size(); i++) {
+            props[i] = xcb_get_property(conn, 0, level[i].first, wm_state,
+                                        XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+            trees[i] = xcb_query_tree(conn, level[i].first);
+        }
 
-    nchildren = 0;
-    XQueryTree(Dpy, Root, &dummywindow, &dummywindow, &children, &nchildren);
-    if(!top) {
-        for(i=0; i<nchildren; i++) {
-            if(XGetWindowAttributes(Dpy, children[i], &attr) && (attr.map_state == IsViewable))
-                children[i] = XmuClientWindow(Dpy, children[i]);
-            else
-                children[i] = 0;
+        for (size_t i = 0; i < level.size(); i++) {
+            xcb_get_property_reply_t* prop =
+                xcb_get_property_reply(conn, props[i], NULL);
+            size_t top = level[i].second;
+            if (prop && prop->type != XCB_NONE && !found[top]) {
+                found[top] = true;
+                clients[top] = level[i].first;
+            }
+            free(prop);
+        }
+
+        vector<pair<xcb_window_t, size_t> > next;
+        for (size_t i = 0; i < level.size(); i++) {
+            size_t top = level[i].second;
+            if (found[top]) {
+                xcb_discard_reply(conn, trees[i].sequence);
+                continue;
+            }
+            xcb_query_tree_reply_t* tree =
+                xcb_query_tree_reply(conn, trees[i], NULL);
+            if (!tree)
+                continue;
+            xcb_window_t* children = xcb_query_tree_children(tree);
+            int nchildren = xcb_query_tree_children_length(tree);
+            for (int j = 0; j < nchildren; j++)
+                next.push_back(make_pair(children[j], top));
+            free(tree);
         }
+        level.swap(next);
     }
+    return clients;
+}
 
-    for(i=0; i<nchildren; i++) {
-        if(children[i])
-            XKillClient(Dpy, children[i]);
+void App::KillAllClients(Bool top) {
+    xcb_connection_t* conn = XGetXCBConnection(Dpy);
+
+    XSync(Dpy, 0);
+    XSetErrorHandler(CatchErrors);
+
+    xcb_query_tree_reply_t* tree =
+        xcb_query_tree_reply(conn, xcb_query_tree(conn, Root), NULL);
+    if (tree) {
+        xcb_window_t* children = xcb_query_tree_children(tree);
+        int nchildren = xcb_query_tree_children_length(tree);
+        vector<xcb_window_t> clients;
+        if (top)
+            clients.assign(children, children + nchildren);
+        else
+            clients = ClientWindows(conn, children, nchildren);
+        free(tree);
+
+        for (size_t i = 0; i < clients.size(); i++)
+            XKillClient(Dpy, clients[i]);
     }
-    XFree((char *)children);
 
     XSync(Dpy, 0);
     XSetErrorHandler(NULL);
@@ -1040,6 +1338,8 @@ void App::StopServer() {
 
     // Catch X error
     XSetIOErrorHandler(IgnoreXIO);
+    if (Dpy)
+        Image::forgetDisplay(Dpy);
     if(!setjmp(CloseEnv) && Dpy)
         XCloseDisplay(Dpy);
 
@@ -1098,41 +1398,8 @@ void App::blankScreen()
 }
 
 void App::setBackground(const string& themedir) {
-    string filename;
-    filename = themedir + "/background.png";
-    image = new Image;
-    bool loaded = image->Read(filename.c_str());
-    if (!loaded){ // try jpeg if png failed
-        filename = "";
-        filename = themedir + "/background.jpg";
-        loaded = image->Read(filename.c_str());
-    }
-    if (loaded) {
-        string bgstyle = cfg->getOption("background_style");
-        if (bgstyle == "stretch") {
-            image->Resize(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-        } else if (bgstyle == "tile") {
-            image->Tile(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-        } else if (bgstyle == "center") {
-            string hexvalue = cfg->getOption("background_color");
-            hexvalue = hexvalue.substr(1,6);
-            image->Center(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)),
-                        hexvalue.c_str());
-        } else { // plain color or error
-            string hexvalue = cfg->getOption("background_color");
-            hexvalue = hexvalue.substr(1,6);
-            image->Center(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)),
-                        hexvalue.c_str());
-        }
-        Pixmap p = image->createPixmap(Dpy, Scr, Root);
-        XSetWindowBackgroundPixmap(Dpy, Root, p);
-        XChangeProperty(Dpy, Root, BackgroundPixmapId, XA_PIXMAP, 32,
-            PropModeReplace, (unsigned char *)&p, 1);
-    }
-    XClearWindow(Dpy, Root);
-
-    XFlush(Dpy);
-    delete image;
+    background->SetTheme(themedir);
+    background->Update();
 }
 
 // Check if there is a lockfile and a corresponding process
@@ -1213,8 +1480,6 @@ string App::findValidRandomTheme(const string& set)
         name = name.substr(0, name.length() - 1);
     }
 
-    Util::srandom(Util::makeseed());
-
     vector<string> themes;
     string themefile;
     Cfg::split(themes, name, ',');
@@ -1246,33 +1511,21 @@ void App::replaceVariables(string& input,
 }
 
 
-/*
- * We rely on the fact that all bits generated by Util::random()
- * are usable, so we are taking full words from its output.
- */
 void App::CreateServerAuth() {
     /* create mit cookie */
-    uint16_t word;
-    uint8_t hi, lo;
-    int i;
+    unsigned char cookie[MCOOKIESIZE / 2];
     string authfile;
-    const char *digits = "0123456789abcdef";
-    Util::srandom(Util::makeseed());
-    for (i = 0; i < MCOOKIESIZE; i+=4) {
-        word = Util::random() & 0xffff;
-        lo = word & 0xff;
-        hi = word >> 8;
-        mcookie[i] = digits[lo & 0x0f];
-        mcookie[i+1] = digits[lo >> 4];
-        mcookie[i+2] = digits[hi & 0x0f];
-        mcookie[i+3] = digits[hi >> 4];
+    if (!Util::getrandom(cookie, sizeof(cookie))) {
+        logStream << APPNAME << ": could not generate auth cookie" << endl;
+        exit(ERR_EXIT);
     }
+    mcookie = Util::bin2hex(cookie, sizeof(cookie));
+    memset(cookie, 0, sizeof(cookie));
     /* reinitialize auth file */
     authfile = cfg->getOption("authfile");
     remove(authfile.c_str());
     putenv(StrConcat("XAUTHORITY=", authfile.c_str()));
-    Util::add_mcookie(mcookie, ":0", cfg->getOption("xauth_path"),
-      authfile);
+    Util::add_mcookie(mcookie, ":0", authfile);
 }
 
 char* App::StrConcat(const char* str1, const char* str2) {
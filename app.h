@@ -23,7 +23,8 @@
 #include <iostream>
 #include "panel.h"
 #include "cfg.h"
-#include "image.h"
+#include "background.h"
+#include "prefetch.h"
 
 #ifdef USE_PAM
 #include "PAM.h"
@@ -49,6 +50,8 @@ public:
 
     bool isServerStarted();
 
+    void PrefetchUser(const std::string& name);
+
 private:
     void Login();
     void Reboot();
@@ -99,11 +102,8 @@ private:
 
     Cfg *cfg;
 
-    Pixmap BackgroundPixmap;
-
     void blankScreen();
-    Image* image;
-    Atom BackgroundPixmapId;
+    Background* background;
     void setBackground(const std::string& themedir);
 
     bool firstlogin;
@@ -115,6 +115,8 @@ private:
 
     std::string themeName;
     std::string mcookie;
+
+    UserPrefetch prefetch;
 };
 
 
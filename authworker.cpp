@@ -0,0 +1,120 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <sys/eventfd.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "authworker.h"
+#include "panel.h"
+
+// The AuthWorker whose task runs on this thread, if any
+static thread_local AuthWorker* current = NULL;
+
+AuthWorker::AuthWorker(Panel* ui)
+    : panel(ui), task(NULL), task_data(NULL), finished(false),
+      request(NULL), request_data(NULL), request_done(false)
+{
+    event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&cond, NULL);
+}
+
+AuthWorker::~AuthWorker() {
+    pthread_cond_destroy(&cond);
+    pthread_mutex_destroy(&mutex);
+    if (event_fd >= 0)
+        close(event_fd);
+}
+
+void* AuthWorker::Thread(void* data) {
+    AuthWorker* self = static_cast<AuthWorker*>(data);
+
+    current = self;
+    self->task(self->task_data);
+    current = NULL;
+
+    pthread_mutex_lock(&self->mutex);
+    self->finished = true;
+    pthread_mutex_unlock(&self->mutex);
+    self->Notify();
+    return NULL;
+}
+
+// Wake up the UI thread
+void AuthWorker::Notify() {
+    uint64_t one = 1;
+    ssize_t ret = write(event_fd, &one, sizeof(one));
+    (void) ret; // can only fail if the counter overflowed
+}
+
+/* Run task on the worker thread. Until it returns, the panel stays live
+ * in its busy state, and calls the worker makes are run here in turn.
+ * Without an eventfd or a thread the task simply runs on this thread.
+ */
+void AuthWorker::Run(Function* fn, void* data) {
+    task = fn;
+    task_data = data;
+    finished = false;
+    request = NULL;
+
+    if (event_fd < 0 || current
+        || pthread_create(&worker, NULL, Thread, this) != 0) {
+        task(task_data);
+        return;
+    }
+
+    pthread_mutex_lock(&mutex);
+    while (!finished) {
+        if (request) {
+            Function* call = request;
+            void* call_data = request_data;
+            pthread_mutex_unlock(&mutex);
+            call(call_data);
+            pthread_mutex_lock(&mutex);
+            request = NULL;
+            request_done = true;
+            pthread_cond_signal(&cond);
+            continue;
+        }
+        pthread_mutex_unlock(&mutex);
+
+        // Nothing to do for the worker: keep the panel alive until it
+        // posts something
+        panel->Busy(event_fd);
+        uint64_t count;
+        ssize_t ret = read(event_fd, &count, sizeof(count));
+        (void) ret; // EAGAIN: woken up for nothing, check again
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    pthread_join(worker, NULL);
+}
+
+// Worker side of Call(): hand function over and wait until it has run
+void AuthWorker::Post(Function* function, void* data) {
+    pthread_mutex_lock(&mutex);
+    request = function;
+    request_data = data;
+    request_done = false;
+    pthread_mutex_unlock(&mutex);
+    Notify();
+
+    pthread_mutex_lock(&mutex);
+    while (!request_done)
+        pthread_cond_wait(&cond, &mutex);
+    pthread_mutex_unlock(&mutex);
+}
+
+void AuthWorker::Call(Function* function, void* data) {
+    if (current)
+        current->Post(function, data);
+    else
+        function(data);
+}
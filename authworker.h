@@ -0,0 +1,63 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _AUTHWORKER_H_
+#define _AUTHWORKER_H_
+
+#include <pthread.h>
+
+class Panel;
+
+/*
+ * Runs a blocking authentication call (pam_authenticate) on a worker
+ * thread while the UI thread keeps serving the panel. The PAM
+ * conversation callback runs on the worker; whatever it needs from the
+ * panel goes through Call(), which hands it to the UI thread through an
+ * eventfd and waits for it to be done. Only the UI thread touches X.
+ */
+class AuthWorker {
+public:
+    typedef void (Function)(void* data);
+
+    AuthWorker(Panel* ui);
+    ~AuthWorker();
+
+    // UI thread: run task on the worker, serving its calls meanwhile
+    void Run(Function* task, void* data);
+
+    // Run function on the UI thread and wait for it. Runs it directly
+    // when not called from an AuthWorker's worker thread.
+    static void Call(Function* function, void* data);
+
+private:
+    AuthWorker();
+    AuthWorker(const AuthWorker&);
+    AuthWorker& operator=(const AuthWorker&);
+
+    static void* Thread(void* data);
+    void Post(Function* function, void* data);
+    void Notify();
+
+    Panel* panel;
+    int event_fd;
+
+    pthread_t worker;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    Function* task;
+    void* task_data;
+    bool finished;
+
+    // call pending from the worker
+    Function* request;
+    void* request_data;
+    bool request_done;
+};
+
+#endif
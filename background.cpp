@@ -0,0 +1,291 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <algorithm>
+
+#include <X11/Xatom.h>
+
+#include "background.h"
+#include "log.h"
+
+using namespace std;
+
+Background::Background(Display* dpy, int scr, Window root, Cfg* config)
+    : Dpy(dpy), Scr(scr), Root(root), cfg(config), image(NULL),
+      image_failed(false), pixmap(None), retained(false),
+      pixmap_width(0), pixmap_height(0)
+{
+    BackgroundPixmapId = XInternAtom(Dpy, "_XROOTPMAP_ID", False);
+    EsetrootPixmapId = XInternAtom(Dpy, "ESETROOT_PMAP_ID", False);
+}
+
+Background::~Background() {
+    FreeScaled(false);
+    // a retained root pixmap is left to the next wallpaper setter
+    if (pixmap != None && !retained)
+        XFreePixmap(Dpy, pixmap);
+    delete image;
+}
+
+// Switch to the background of a theme; nothing is read until needed
+void Background::SetTheme(const string& dir) {
+    if (dir == themedir)
+        return;
+
+    themedir = dir;
+    delete image;
+    image = NULL;
+    image_failed = false;
+    FreeScaled(true);
+    monitors.clear();   // everything has to be drawn again
+}
+
+bool Background::LoadImage() {
+    if (image)
+        return true;
+    if (image_failed)
+        return false;
+
+    image = new Image;
+    image->Dither(cfg->getOption("dither") == "yes");
+    string filename = themedir + "/background.png";
+    bool loaded = image->Read(filename.c_str());
+    if (!loaded) { // try jpeg if png failed
+        filename = themedir + "/background.jpg";
+        loaded = image->Read(filename.c_str());
+    }
+    if (!loaded) {
+        delete image;
+        image = NULL;
+        image_failed = true;
+    }
+    return loaded;
+}
+
+// The background laid out on a width x height monitor
+Pixmap Background::Scaled(unsigned int width, unsigned int height) {
+    ScaledMap::iterator it = scaled.find(make_pair(width, height));
+    if (it != scaled.end())
+        return it->second;
+
+    string hexvalue = cfg->getOption("background_color");
+    hexvalue = hexvalue.substr(1,6);
+    Image::BackgroundStyle style =
+        Image::backgroundStyle(cfg->getOption("background_style").c_str());
+
+    Pixmap p = None;
+    if (cfg->getOption("render_backend") == "xrender")
+        p = image->renderPixmap(Dpy, Scr, Root, width, height, style,
+                                hexvalue.c_str());
+    if (p == None) // no Render extension or disabled
+        p = image->createPixmap(Dpy, Scr, Root, width, height, style,
+                                hexvalue.c_str());
+
+    scaled[make_pair(width, height)] = p;
+    return p;
+}
+
+bool Background::IsScaled(Pixmap p) const {
+    for (ScaledMap::const_iterator it = scaled.begin(); it != scaled.end(); ++it) {
+        if (it->second == p)
+            return true;
+    }
+    return false;
+}
+
+// Free the scaled pixmaps, except the root background if keep_root is set
+void Background::FreeScaled(bool keep_root) {
+    for (ScaledMap::iterator it = scaled.begin(); it != scaled.end(); ++it) {
+        if (!(keep_root && it->second == pixmap))
+            XFreePixmap(Dpy, it->second);
+    }
+    scaled.clear();
+}
+
+// The pixmap a root window property points to, None if not set
+Pixmap Background::RootPixmap(Atom property) {
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char* data = NULL;
+    Pixmap p = None;
+
+    if (XGetWindowProperty(Dpy, Root, property, 0, 1, False, XA_PIXMAP,
+                           &type, &format, &count, &after, &data) == Success
+        && type == XA_PIXMAP && format == 32 && count == 1)
+        p = *reinterpret_cast<Pixmap*>(data);
+    if (data)
+        XFree(data);
+    return p;
+}
+
+/* A wallpaper setter run in the last session (Esetroot, feh, ...) keeps
+ * its pixmap alive after exiting with RetainPermanent, and publishes it
+ * as ESETROOT_PMAP_ID. Whoever replaces the root background frees it by
+ * killing its client, as those programs do among themselves; otherwise
+ * the server keeps a screen-sized pixmap for every session.
+ */
+void Background::ReleaseRetained() {
+    Pixmap current = RootPixmap(BackgroundPixmapId);
+
+    // ours went away with the setter which replaced it
+    if (retained && current != pixmap) {
+        pixmap = None;
+        retained = false;
+        monitors.clear();
+    }
+    if (current == None || current == pixmap)
+        return;
+
+    // only a pixmap both properties agree on, as Esetroot and feh check
+    if (RootPixmap(EsetrootPixmapId) == current) {
+        XKillClient(Dpy, current);
+        XDeleteProperty(Dpy, Root, EsetrootPixmapId);
+    }
+}
+
+/* Our side of the same convention: the root background is a copy made
+ * by a connection of its own, which the server keeps with RetainPermanent
+ * once it is closed, named by _XROOTPMAP_ID and ESETROOT_PMAP_ID alike.
+ * The next setter frees it with XKillClient() without taking slim down,
+ * and we draw into it in place on the next Update(). Without a second
+ * connection our own pixmap is installed, and only _XROOTPMAP_ID set.
+ */
+void Background::Publish(unsigned int width, unsigned int height,
+                         unsigned int depth) {
+    Display* owner = retained ? NULL : XOpenDisplay(DisplayString(Dpy));
+    if (owner) {
+        // the copy must see everything drawn into pixmap so far
+        XSync(Dpy, False);
+        Pixmap copy = XCreatePixmap(owner, Root, width, height, depth);
+        GC gc = XCreateGC(owner, copy, 0, NULL);
+        XCopyArea(owner, pixmap, copy, gc, 0, 0, width, height, 0, 0);
+        XFreeGC(owner, gc);
+        XSetCloseDownMode(owner, RetainPermanent);
+        XCloseDisplay(owner);
+
+        if (!IsScaled(pixmap))
+            XFreePixmap(Dpy, pixmap);
+        pixmap = copy;
+        retained = true;
+    }
+
+    XSetWindowBackgroundPixmap(Dpy, Root, pixmap);
+    XChangeProperty(Dpy, Root, BackgroundPixmapId, XA_PIXMAP, 32,
+                    PropModeReplace, (unsigned char *)&pixmap, 1);
+    if (retained)
+        XChangeProperty(Dpy, Root, EsetrootPixmapId, XA_PIXMAP, 32,
+                        PropModeReplace, (unsigned char *)&pixmap, 1);
+    else
+        XDeleteProperty(Dpy, Root, EsetrootPixmapId);
+    XClearWindow(Dpy, Root);
+    XFlush(Dpy);
+}
+
+/*
+ * Lay the background out on the current monitors and install it on the
+ * root window. Monitors which kept their geometry since the last call
+ * are not drawn again.
+ */
+void Background::Update() {
+    int primary;
+    vector<Rectangle> now = Monitor::List(Dpy, Scr, Root, &primary);
+
+    Window root_return;
+    int x, y;
+    unsigned int width, height, border, depth;
+    XGetGeometry(Dpy, Root, &root_return, &x, &y, &width, &height,
+                 &border, &depth);
+
+    ReleaseRetained();
+
+    if (now == monitors && pixmap != None
+        && (int) width == pixmap_width && (int) height == pixmap_height) {
+        // unchanged: just make sure it is (still) the root background
+    } else if (!LoadImage()) {
+        XClearWindow(Dpy, Root);
+        XFlush(Dpy);
+        return;
+    } else if (now.size() == 1 && now[0] == Rectangle(0, 0, width, height)) {
+        // a single monitor: the scaled pixmap is the background itself
+        Pixmap p = Scaled(width, height);
+        if (pixmap != None && pixmap != p && !IsScaled(pixmap))
+            XFreePixmap(Dpy, pixmap);
+        pixmap = p;
+        retained = false;
+    } else {
+        Pixmap old = pixmap;
+        bool reuse = old != None && !IsScaled(old)
+                     && (int) width == pixmap_width
+                     && (int) height == pixmap_height;
+
+        // a monitor gone leaves its picture behind in the old pixmap:
+        // start from a clean one, the kept monitors are copied over
+        for (vector<Rectangle>::size_type j = 0; reuse && j < monitors.size(); j++) {
+            if (find(now.begin(), now.end(), monitors[j]) == now.end())
+                reuse = false;
+        }
+
+        if (!reuse) {
+            pixmap = XCreatePixmap(Dpy, Root, width, height, depth);
+            retained = false;
+
+            // the areas not shown on any monitor
+            XColor color;
+            Colormap colormap = DefaultColormap(Dpy, Scr);
+            GC gc = XCreateGC(Dpy, Root, 0, NULL);
+            if (XParseColor(Dpy, colormap,
+                            cfg->getOption("background_color").c_str(), &color)
+                && XAllocColor(Dpy, colormap, &color))
+                XSetForeground(Dpy, gc, color.pixel);
+            else
+                XSetForeground(Dpy, gc, BlackPixel(Dpy, Scr));
+            XFillRectangle(Dpy, pixmap, gc, 0, 0, width, height);
+            XFreeGC(Dpy, gc);
+        }
+
+        GC gc = XCreateGC(Dpy, pixmap, 0, NULL);
+        for (vector<Rectangle>::size_type i = 0; i < now.size(); i++) {
+            const Rectangle& m = now[i];
+            bool drawn = false;
+            for (vector<Rectangle>::size_type j = 0; j < monitors.size(); j++) {
+                if (monitors[j] == m)
+                    drawn = old != None;
+            }
+            if (drawn && reuse)
+                continue;
+
+            if (drawn && m.x + m.width <= (unsigned) pixmap_width
+                && m.y + m.height <= (unsigned) pixmap_height) {
+                // still valid in the old pixmap, no need to lay it out
+                XCopyArea(Dpy, old, pixmap, gc, m.x, m.y,
+                          m.width, m.height, m.x, m.y);
+            } else {
+                XCopyArea(Dpy, Scaled(m.width, m.height), pixmap, gc,
+                          0, 0, m.width, m.height, m.x, m.y);
+            }
+        }
+        XFreeGC(Dpy, gc);
+
+        if (old != None && old != pixmap && !IsScaled(old))
+            XFreePixmap(Dpy, old);
+    }
+
+    monitors = now;
+    pixmap_width = width;
+    pixmap_height = height;
+
+    Publish(width, height, depth);
+}
+
+// Drop the decoded image and the scaled pixmaps not on screen
+void Background::FreeResources() {
+    FreeScaled(true);
+    delete image;
+    image = NULL;
+}
@@ -0,0 +1,73 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _BACKGROUND_H_
+#define _BACKGROUND_H_
+
+#include <X11/Xlib.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cfg.h"
+#include "image.h"
+#include "monitor.h"
+
+/*
+ * The theme background of the root window. The image is laid out on
+ * every monitor separately; monitors sharing a resolution share one
+ * scaled pixmap, and Update() only redraws the monitors whose geometry
+ * changed since the last call. The root pixmap stays ours from one
+ * greeter cycle to the next; on an unchanged screen it is installed
+ * again as it is.
+ */
+class Background {
+public:
+    Background(Display* dpy, int scr, Window root, Cfg* config);
+    ~Background();
+
+    void SetTheme(const std::string& themedir);
+    void Update();
+    void FreeResources();
+
+private:
+    Background();
+    Background(const Background&);
+    Background& operator=(const Background&);
+
+    bool LoadImage();
+    Pixmap Scaled(unsigned int width, unsigned int height);
+    bool IsScaled(Pixmap p) const;
+    void FreeScaled(bool keep_root);
+    Pixmap RootPixmap(Atom property);
+    void ReleaseRetained();
+    void Publish(unsigned int width, unsigned int height, unsigned int depth);
+
+    typedef std::map<std::pair<unsigned int, unsigned int>, Pixmap> ScaledMap;
+
+    Display* Dpy;
+    int Scr;
+    Window Root;
+    Cfg* cfg;
+    Atom BackgroundPixmapId;
+    Atom EsetrootPixmapId;
+
+    std::string themedir;
+    Image* image;               // decoded on first use
+    bool image_failed;
+
+    ScaledMap scaled;           // background laid out per resolution
+    Pixmap pixmap;              // current root background
+    bool retained;              // pixmap is the RetainPermanent copy
+    int pixmap_width;
+    int pixmap_height;
+    std::vector<Rectangle> monitors;    // layout drawn into pixmap
+};
+
+#endif /* _BACKGROUND_H_ */
@@ -34,12 +34,12 @@ Cfg::Cfg()
     options.insert(option("xserver_arguments",""));
     options.insert(option("numlock",""));
     options.insert(option("daemon",""));
-    options.insert(option("xauth_path","/usr/bin/xauth"));
     options.insert(option("login_cmd","exec /bin/bash -login ~/.xinitrc %session"));
     options.insert(option("halt_cmd","/sbin/shutdown -h now"));
     options.insert(option("reboot_cmd","/sbin/shutdown -r now"));
     options.insert(option("suspend_cmd",""));
     options.insert(option("sessionstart_cmd",""));
+    options.insert(option("sessionstart_async","no"));
     options.insert(option("sessionstop_cmd",""));
     options.insert(option("xsetup_script",""));
     options.insert(option("console_cmd","/usr/bin/xterm -C -fg white -bg black +sb -g %dx%d+%d+%d -fn %dx%d -T ""Console login"" -e /bin/sh -c ""/bin/cat /etc/issue; exec /bin/login"""));
@@ -55,10 +55,13 @@ Cfg::Cfg()
     options.insert(option("authfile","/var/run/slim.auth"));
     options.insert(option("shutdown_msg","The system is halting..."));
     options.insert(option("reboot_msg","The system is rebooting..."));
+    options.insert(option("authenticating_msg","Authenticating..."));
     options.insert(option("sessions","wmaker,blackbox,icewm"));
     options.insert(option("sessiondir",""));
     options.insert(option("hidecursor","false"));
     options.insert(option("allow_exit", "true"));
+    options.insert(option("render_backend", "xrender"));
+    options.insert(option("dither", "yes"));
 
     // Theme stuff
     options.insert(option("input_panel_x","50%"));
@@ -37,6 +37,27 @@
  */
 #define ERROR_DURATION  5
 
+/* how long authentication may take, in milliseconds, before
+ * the "authenticating" message is shown
+ */
+#define BUSY_MSG_DELAY  150
+
+/* how often slimlock tries again to grab the keyboard while another
+ * client holds it, in milliseconds
+ */
+#define GRAB_RETRY  100
+
+/* how long to wait for a background user lookup, in milliseconds,
+ * before giving up on it and looking the user up directly
+ */
+#define PREFETCH_TIMEOUT  2000
+
+/* how long a helper child of the login (the Xauthority writer, an async
+ * sessionstart_cmd still running after logout) is waited for, in
+ * milliseconds, before it is killed
+ */
+#define HELPER_TIMEOUT  2000
+
 // variables replaced in login_cmd
 #define SESSION_VAR     "%session"
 #define THEME_VAR       "%theme"
@@ -18,39 +18,168 @@
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <stdint.h>
 
 using namespace std;
 
 #include "image.h"
 
+#include <X11/extensions/Xrender.h>
+
 extern "C" {
     #include <jpeglib.h>
     #include <png.h>
 }
 
-Image::Image() : width(0), height(0), area(0),
-rgb_data(NULL), png_alpha(NULL), quality_(80) {}
+/* Rows rendered per XPutImage when a background is built band by band */
+#define IMAGE_BAND_ROWS 64
 
-Image::Image(const int w, const int h, const unsigned char *rgb, const unsigned char *alpha) :
-width(w), height(h), area(w*h), quality_(80) {
-    width = w;
-    height = h;
-    area = w * h;
+/* Multiply by a/255 with correct rounding, for 0 <= v <= 255*255 */
+static inline uint32_t div255(uint32_t v) {
+    v += 128;
+    return (v + (v >> 8)) >> 8;
+}
 
-    rgb_data = (unsigned char *) malloc(3 * area);
-    memcpy(rgb_data, rgb, 3 * area);
+/* Build a premultiplied 0xAARRGGBB pixel from straight components */
+static inline uint32_t packPixel(uint32_t r, uint32_t g, uint32_t b,
+                                 uint32_t a) {
+    if (a != 0xff) {
+        r = div255(r * a);
+        g = div255(g * a);
+        b = div255(b * a);
+    }
+    return (a << 24) | (r << 16) | (g << 8) | b;
+}
 
-    if (alpha == NULL) {
-        png_alpha = NULL;
-    } else {
-        png_alpha = (unsigned char *) malloc(area);
-        memcpy(png_alpha, alpha, area);
+/* The straight color of a premultiplied pixel, made opaque: what the
+ * pixel looks like once its alpha is dropped. A fully transparent pixel
+ * has no color left and comes out black.
+ */
+static inline uint32_t opaquePixel(uint32_t p) {
+    uint32_t a = p >> 24;
+    if (a == 0xff)
+        return p;
+    if (a == 0)
+        return 0xff000000;
+
+    uint32_t r = (((p >> 16) & 0xff) * 255 + a / 2) / a;
+    uint32_t g = (((p >> 8) & 0xff) * 255 + a / 2) / a;
+    uint32_t b = ((p & 0xff) * 255 + a / 2) / a;
+    return 0xff000000 | ((r > 255 ? 255 : r) << 16)
+                      | ((g > 255 ? 255 : g) << 8) | (b > 255 ? 255 : b);
+}
+
+/* Porter-Duff "over" of two premultiplied pixels, two channels at a time */
+static inline uint32_t blendOver(uint32_t src, uint32_t dst) {
+    uint32_t a = src >> 24;
+    if (a == 0xff)
+        return src;
+    if (a == 0)
+        return dst;
+
+    uint32_t inv = 0xff - a;
+    uint32_t rb = (dst & 0x00ff00ff) * inv + 0x00800080;
+    rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+    uint32_t ag = ((dst >> 8) & 0x00ff00ff) * inv + 0x00800080;
+    ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+    return src + rb + ag;
+}
+
+static uint32_t hexPixel(const char *hex) {
+    unsigned long packed_rgb = 0;
+    sscanf(hex, "%lx", &packed_rgb);
+    return 0xff000000 | (packed_rgb & 0xffffff);
+}
+
+static void fillRow(uint32_t *row, const int w, const uint32_t pixel) {
+    for (int i = 0; i < w; i++)
+        row[i] = pixel;
+}
+
+/* Copy the pixels of src into dst (which must be at least as large) */
+static void copyView(const ImageView &src, const ImageView &dst) {
+    for (int j = 0; j < src.height; j++)
+        memcpy(dst.Row(j), src.Row(j), 4 * src.width);
+}
+
+/* Fill a w pixel row by repeating its first n pixels, doubling the
+ * copied span every pass so only log2(w/n) memcpy calls are needed.
+ */
+static void repeatRow(uint32_t *row, const int n, const int w) {
+    int filled = n;
+    while (filled < w) {
+        int chunk = (w - filled < filled) ? w - filled : filled;
+        memcpy(row + filled, row, 4 * chunk);
+        filled += chunk;
     }
 }
 
+Image::Image() : width(0), height(0), stride(0),
+buffer(NULL), pixels(NULL), has_alpha(false), quality_(80), dither_(true) {}
+
+Image::Image(const int w, const int h, const unsigned char *rgb, const unsigned char *alpha) :
+width(0), height(0), stride(0), buffer(NULL), pixels(NULL), has_alpha(false),
+quality_(80), dither_(true) {
+    int new_stride;
+    uint32_t *new_pixels = allocPixels(w, h, &new_stride);
+    if (new_pixels == NULL)
+        return;
+
+    int ipos = 0;
+    for (int j = 0; j < h; j++) {
+        uint32_t *row = (uint32_t *) ((char *) new_pixels + j * new_stride);
+        for (int i = 0; i < w; i++) {
+            row[i] = packPixel(rgb[3*ipos], rgb[3*ipos + 1], rgb[3*ipos + 2],
+                               alpha ? alpha[ipos] : 0xff);
+            ipos++;
+        }
+    }
+    setPixels(new_pixels, w, h, new_stride, alpha != NULL);
+}
+
+/* Deep copy; only the pixels in view are copied */
+Image::Image(const Image& image) :
+width(0), height(0), stride(0), buffer(NULL), pixels(NULL), has_alpha(false),
+quality_(image.quality_), dither_(image.dither_) {
+    int new_stride;
+    uint32_t *new_pixels = allocPixels(image.width, image.height, &new_stride);
+    if (new_pixels == NULL)
+        return;
+
+    copyView(image.View(), ImageView(new_pixels, new_stride,
+                                     image.width, image.height));
+    setPixels(new_pixels, image.width, image.height, new_stride,
+              image.has_alpha);
+}
+
 Image::~Image() {
-    free(rgb_data);
-    free(png_alpha);
+    free(buffer);
+}
+
+/* Allocate a w x h pixel buffer with IMAGE_ROW_ALIGN aligned rows */
+uint32_t *
+Image::allocPixels(const int w, const int h, int *new_stride) {
+    void *data = NULL;
+    *new_stride = (4 * w + IMAGE_ROW_ALIGN - 1) & ~(IMAGE_ROW_ALIGN - 1);
+    size_t size = (size_t) *new_stride * h;
+    if (size == 0)
+        size = IMAGE_ROW_ALIGN;
+    if (posix_memalign(&data, IMAGE_ROW_ALIGN, size) != 0) {
+        logStream << APPNAME << ": Can't allocate memory for image." << endl;
+        return NULL;
+    }
+    return (uint32_t *) data;
+}
+
+void
+Image::setPixels(uint32_t *data, const int w, const int h,
+                 const int new_stride, const bool alpha) {
+    free(buffer);
+    buffer = pixels = data;
+    width = w;
+    height = h;
+    stride = new_stride;
+    has_alpha = alpha;
 }
 
 bool
@@ -70,10 +199,10 @@ Image::Read(const char *filename) {
     fclose(file);
 
     if ((ubuf[0] == 0x89) && !strncmp("PNG", buf+1, 3)) {
-        success = readPng(filename, &width, &height, &rgb_data, &png_alpha);
+        success = readPng(filename);
     }
     else if ((ubuf[0] == 0xff) && (ubuf[1] == 0xd8)){
-        success = readJpeg(filename, &width, &height, &rgb_data);
+        success = readJpeg(filename);
     } else {
         fprintf(stderr, "Unknown image format\n");
         success = 0;
@@ -90,44 +219,34 @@ Image::Reduce(const int factor) {
     for (int i = 0; i < factor; i++)
         scale *= 2;
 
-    double scale2 = scale*scale;
+    const int scale2 = scale*scale;
 
     int w = width / scale;
     int h = height / scale;
-    int new_area = w * h;
+    int new_stride;
 
-    unsigned char *new_rgb = (unsigned char *) malloc(3 * new_area);
-    memset(new_rgb, 0, 3 * new_area);
-
-    unsigned char *new_alpha = NULL;
-    if (png_alpha != NULL) {
-        new_alpha = (unsigned char *) malloc(new_area);
-        memset(new_alpha, 0, new_area);
-    }
+    uint32_t *new_pixels = allocPixels(w, h, &new_stride);
+    if (new_pixels == NULL)
+        return;
 
-    int ipos = 0;
-    for (int j = 0; j < height; j++) {
-        int js = j / scale;
-        for (int i = 0; i < width; i++) {
-            int is = i/scale;
-            for (int k = 0; k < 3; k++)
-                new_rgb[3*(js * w + is) + k] += static_cast<unsigned char> ((rgb_data[3*ipos + k] + 0.5) / scale2);
-
-            if (png_alpha != NULL)
-                new_alpha[js * w + is] += static_cast<unsigned char> (png_alpha[ipos]/scale2);
-            ipos++;
+    for (int js = 0; js < h; js++) {
+        uint32_t *out = (uint32_t *) ((char *) new_pixels + js * new_stride);
+        for (int is = 0; is < w; is++) {
+            uint32_t sum[4] = { 0, 0, 0, 0 };
+            for (int j = js * scale; j < (js + 1) * scale; j++) {
+                const uint32_t *in = getRow(j) + is * scale;
+                for (int i = 0; i < scale; i++) {
+                    for (int k = 0; k < 4; k++)
+                        sum[k] += (in[i] >> (8 * k)) & 0xff;
+                }
+            }
+            out[is] = 0;
+            for (int k = 0; k < 4; k++)
+                out[is] |= ((sum[k] + scale2 / 2) / scale2) << (8 * k);
         }
     }
 
-    free(rgb_data);
-    free(png_alpha);
-
-    rgb_data = new_rgb;
-    png_alpha = new_alpha;
-    width = w;
-    height = h;
-
-    area = w * h;
+    setPixels(new_pixels, w, h, new_stride, has_alpha);
 }
 
 void
@@ -137,50 +256,32 @@ Image::Resize(const int w, const int h) {
         return;
     }
 
-    int new_area = w * h;
-
-    unsigned char *new_rgb = (unsigned char *) malloc(3 * new_area);
-    unsigned char *new_alpha = NULL;
-    if (png_alpha != NULL)
-        new_alpha = (unsigned char *) malloc(new_area);
+    int new_stride;
+    uint32_t *new_pixels = allocPixels(w, h, &new_stride);
+    if (new_pixels == NULL)
+        return;
 
     const double scale_x = ((double) w) / width;
     const double scale_y = ((double) h) / height;
 
-    int ipos = 0;
+    // pixel centres map onto pixel centres, as Render's transforms do
     for (int j = 0; j < h; j++) {
-        const double y = j / scale_y;
+        const double y = (j + 0.5) / scale_y - 0.5;
+        uint32_t *out = (uint32_t *) ((char *) new_pixels + j * new_stride);
         for (int i = 0; i < w; i++) {
-            const double x = i / scale_x;
-            if (new_alpha == NULL)
-                getPixel(x, y, new_rgb + 3*ipos);
-            else
-                getPixel(x, y, new_rgb + 3*ipos, new_alpha + ipos);
-            ipos++;
+            const double x = (i + 0.5) / scale_x - 0.5;
+            out[i] = getPixel(x, y);
         }
     }
 
-    free(rgb_data);
-    free(png_alpha);
-
-    rgb_data = new_rgb;
-    png_alpha = new_alpha;
-    width = w;
-    height = h;
-
-    area = w * h;
+    setPixels(new_pixels, w, h, new_stride, has_alpha);
 }
 
 // Find the color of the desired point using bilinear interpolation.
 // Assume the array indices refer to the denter of the pixel, so each
 // pixel has corners at (i - 0.5, j - 0.5) and (i + 0.5, j + 0.5)
-void
-Image::getPixel(double x, double y, unsigned char *pixel) {
-    getPixel(x, y, pixel, NULL);
-}
-
-void
-Image::getPixel(double x, double y, unsigned char *pixel, unsigned char *alpha) {
+uint32_t
+Image::getPixel(double x, double y) const {
     if (x < -0.5)
         x = -0.5;
     if (x >= width - 0.5)
@@ -194,9 +295,9 @@ Image::getPixel(double x, double y, unsigned char *pixel, unsigned char *alpha)
     int ix0 = (int) (floor(x));
     int ix1 = ix0 + 1;
     if (ix0 < 0)
-        ix0 = width - 1;
+        ix0 = 0;
     if (ix1 >= width)
-        ix1 = 0;
+        ix1 = width - 1;
 
     int iy0 = (int) (floor(y));
     int iy1 = iy0 + 1;
@@ -214,34 +315,28 @@ Image::getPixel(double x, double y, unsigned char *pixel, unsigned char *alpha)
     weight[2] = 1 - t - u + weight[1];
     weight[3] = t - weight[1];
 
-    unsigned char *pixels[4];
-    pixels[0] = rgb_data + 3 * (iy0 * width + ix0);
-    pixels[1] = rgb_data + 3 * (iy0 * width + ix1);
-    pixels[2] = rgb_data + 3 * (iy1 * width + ix0);
-    pixels[3] = rgb_data + 3 * (iy1 * width + ix1);
-
-    memset(pixel, 0, 3);
-    for (int i = 0; i < 4; i++) {
-        for (int j = 0; j < 3; j++)
-            pixel[j] += (unsigned char) (weight[i] * pixels[i][j]);
-    }
-
-    if (alpha != NULL) {
-        unsigned char pixels[4];
-        pixels[0] = png_alpha[iy0 * width + ix0];
-        pixels[1] = png_alpha[iy0 * width + ix1];
-        pixels[2] = png_alpha[iy0 * width + ix0];
-        pixels[3] = png_alpha[iy1 * width + ix1];
+    uint32_t pixels[4];
+    pixels[0] = getRow(iy0)[ix0];
+    pixels[1] = getRow(iy0)[ix1];
+    pixels[2] = getRow(iy1)[ix0];
+    pixels[3] = getRow(iy1)[ix1];
 
+    uint32_t pixel = 0;
+    for (int k = 0; k < 32; k += 8) {
+        double value = 0.5;
         for (int i = 0; i < 4; i++)
-            *alpha = (unsigned char) (weight[i] * pixels[i]);
+            value += weight[i] * ((pixels[i] >> k) & 0xff);
+        uint32_t c = (uint32_t) value;
+        pixel |= (c > 0xff ? 0xff : c) << k;
     }
+    return pixel;
 }
 
 /* Merge the image with a background, taking care of the
  * image Alpha transparency. (background alpha is ignored).
  * The images is merged on position (x, y) on the
  * background, the background must contain the image.
+ * The image keeps its size; the background is left untouched.
  */
 void Image::Merge(Image* background, const int x, const int y) {
 
@@ -249,43 +344,18 @@ void Image::Merge(Image* background, const int x, const int y) {
         return;
     }
 
-    if (background->Width()*background->Height() != width*height)
-        background->Crop(x, y, width, height);
+    if (!has_alpha)
+        return;
 
-    double tmp;
-    unsigned char *new_rgb = (unsigned char *) malloc(3 * width * height);
-    memset(new_rgb, 0, 3 * width * height);
-    const unsigned char *bg_rgb = background->getRGBData();
-    
-    int ipos = 0;
-    if (png_alpha != NULL){
-        for (int j = 0; j < height; j++) {
-            for (int i = 0; i < width; i++) {
-                for (int k = 0; k < 3; k++) {
-                    tmp = rgb_data[3*ipos + k]*png_alpha[ipos]/255.0
-                            + bg_rgb[3*ipos + k]*(1-png_alpha[ipos]/255.0);
-                    new_rgb[3*ipos + k] = static_cast<unsigned char> (tmp);
-                }
-                ipos++;
-            }
-        }
-    } else {
-        for (int j = 0; j < height; j++) {
-            for (int i = 0; i < width; i++) {
-                for (int k = 0; k < 3; k++) {
-                    tmp = rgb_data[3*ipos + k];
-                    new_rgb[3*ipos + k] = static_cast<unsigned char> (tmp);
-                }
-                ipos++;
-            }
-        }
+    ImageView bg = background->View().Sub(x, y, width, height);
+    for (int j = 0; j < height; j++) {
+        uint32_t *row = getRow(j);
+        const uint32_t *bg_row = bg.Row(j);
+        for (int i = 0; i < width; i++)
+            row[i] = blendOver(row[i], opaquePixel(bg_row[i]));
     }
 
-    free(rgb_data);
-    free(png_alpha);
-    rgb_data = new_rgb;
-    png_alpha = NULL;
-
+    has_alpha = false;
 }
 
 /* Merge the image with a background, taking care of the
@@ -293,7 +363,6 @@ void Image::Merge(Image* background, const int x, const int y) {
  * The images is merged on position (x, y) on the
  * background, the background must contain the image.
  */
-#define IMG_POS_RGB(p, x) (3 * p + x)
 void Image::Merge_non_crop(Image* background, const int x, const int y)
 {
 	int bg_w = background->Width();
@@ -302,47 +371,62 @@ void Image::Merge_non_crop(Image* background, const int x, const int y)
 	if (x + width > bg_w || y + height > bg_h)
 		return;
 
-	double tmp;
-	unsigned char *new_rgb = (unsigned char *)malloc(3 * bg_w * bg_h);
-	const unsigned char *bg_rgb = background->getRGBData();
-	int pnl_pos = 0;
-	int bg_pos = 0;
-	int pnl_w_end = x + width;
-	int pnl_h_end = y + height;
-
-	memcpy(new_rgb, bg_rgb, 3 * bg_w * bg_h);
-
-	for (int j = 0; j < bg_h; j++) {
-		for (int i = 0; i < bg_w; i++) {
-			if (j >= y && i >= x && j < pnl_h_end && i < pnl_w_end ) {
-				for (int k = 0; k < 3; k++) {
-					if (png_alpha != NULL)
-						tmp = rgb_data[IMG_POS_RGB(pnl_pos, k)]
-							* png_alpha[pnl_pos]/255.0
-							+ bg_rgb[IMG_POS_RGB(bg_pos, k)]
-							* (1 - png_alpha[pnl_pos]/255.0);
-					else
-						tmp = rgb_data[IMG_POS_RGB(pnl_pos, k)];
-
-					new_rgb[IMG_POS_RGB(bg_pos, k)] = static_cast<unsigned char>(tmp);
-				}
-				pnl_pos++;
-			}
-			bg_pos++;
+	int new_stride;
+	uint32_t *new_pixels = allocPixels(bg_w, bg_h, &new_stride);
+	if (new_pixels == NULL)
+		return;
+
+	ImageView out(new_pixels, new_stride, bg_w, bg_h);
+	copyView(background->View(), out);
+
+	out = out.Sub(x, y, width, height);
+	for (int j = 0; j < height; j++) {
+		uint32_t *row = out.Row(j);
+		const uint32_t *pnl_row = getRow(j);
+		if (has_alpha) {
+			for (int i = 0; i < width; i++)
+				row[i] = blendOver(pnl_row[i], opaquePixel(row[i]));
+		} else {
+			memcpy(row, pnl_row, 4 * width);
 		}
 	}
 
-	width = bg_w;
-	height = bg_h;
+	setPixels(new_pixels, bg_w, bg_h, new_stride, false);
+}
+
+/* Merge the image with the (x, y) region of background laid out in
+ * the given style on a w x h area, like Merge() on a background that
+ * went through Resize(), Tile() or Center(). Only the rows behind the
+ * image are rendered, the laid out background is never built.
+ */
+void Image::Merge(const Image* background, const int x, const int y,
+                  const int w, const int h, const BackgroundStyle style,
+                  const char *hex) {
+
+    if (x + width > w || y + height > h) {
+        return;
+    }
+
+    if (!has_alpha)
+        return;
 
-	free(rgb_data);
-	free(png_alpha);
-	rgb_data = new_rgb;
-	png_alpha = NULL;
+    uint32_t *line = (uint32_t *) malloc(4 * width);
+    if (line == NULL)
+        return;
+
+    const uint32_t color = hexPixel(hex);
+    for (int j = 0; j < height; j++) {
+        uint32_t *row = getRow(j);
+        background->renderRow(line, x, y + j, width, w, h, style, color);
+        for (int i = 0; i < width; i++)
+            row[i] = blendOver(row[i], line[i]);
+    }
+    free(line);
+
+    has_alpha = false;
 }
 
-/* Tile the image growing its size to the minimum entire
- * multiple of w * h.
+/* Tile the image growing its size to w * h.
  * The new dimensions should be > of the current ones.
  * Note that this flattens image (alpha removed)
  */
@@ -351,92 +435,41 @@ void Image::Tile(const int w, const int h) {
     if (w < width || h < height)
         return;
 
-    int nx = w / width;
-    if (w % width > 0)
-        nx++;
-    int ny = h / height;
-    if (h % height > 0)
-        ny++;
+    int new_stride;
+    uint32_t *new_pixels = allocPixels(w, h, &new_stride);
+    if (new_pixels == NULL)
+        return;
 
-    int newwidth = nx*width;
-    int newheight=ny*height;
-        
-    unsigned char *new_rgb = (unsigned char *) malloc(3 * newwidth * newheight);
-    memset(new_rgb, 0, 3 * width * height * nx * ny);
+    ImageView out(new_pixels, new_stride, w, h);
 
-    int ipos = 0;
-    int opos = 0;
-
-    for (int r = 0; r < ny; r++) {
-        for (int c = 0; c < nx; c++) {
-            for (int j = 0; j < height; j++) {
-                for (int i = 0; i < width; i++) {
-                    opos = j*width + i;
-                    ipos = r*width*height*nx + j*newwidth + c*width +i;
-                    for (int k = 0; k < 3; k++) {
-                        new_rgb[3*ipos + k] = static_cast<unsigned char> (rgb_data[3*opos + k]);
-                    }
-                }
-            }
-        }
+    // first band: one copy of each source row, then double it up to w
+    for (int j = 0; j < height; j++) {
+        uint32_t *row = out.Row(j);
+        const uint32_t *in = getRow(j);
+        for (int i = 0; i < width; i++)
+            row[i] = opaquePixel(in[i]);
+        repeatRow(row, width, w);
     }
 
-    free(rgb_data);
-    free(png_alpha);
-    rgb_data = new_rgb;
-    png_alpha = NULL;
-    width = newwidth;
-    height = newheight;
-    area = width * height;
-    Crop(0,0,w,h);
+    // the remaining bands repeat the first one, a whole row at a time
+    for (int j = height; j < h; j++)
+        memcpy(out.Row(j), out.Row(j - height), 4 * w);
 
+    setPixels(new_pixels, w, h, new_stride, false);
 }
 
-/* Crop the image
+/* Crop the image. Only the view into the pixel buffer changes,
+ * no pixel is copied.
  */
 void Image::Crop(const int x, const int y, const int w, const int h) {
 
-    if (x+w > width || y+h > height) {
+    if (x < 0 || y < 0 || x+w > width || y+h > height) {
         return;
     }
 
-    int x2 = x + w;
-    int y2 = y + h;
-    unsigned char *new_rgb = (unsigned char *) malloc(3 * w * h);
-    memset(new_rgb, 0, 3 * w * h);
-    unsigned char *new_alpha = NULL;
-    if (png_alpha != NULL) {
-        new_alpha = (unsigned char *) malloc(w * h);
-        memset(new_alpha, 0, w * h);
-    }
-
-    int ipos = 0;
-    int opos = 0;
-
-    for (int j = 0; j < height; j++) {
-        for (int i = 0; i < width; i++) {
-            if (j>=y && i>=x && j<y2 && i<x2) {
-                for (int k = 0; k < 3; k++) {
-                    new_rgb[3*ipos + k] = static_cast<unsigned char> (rgb_data[3*opos + k]);
-                }
-                if (png_alpha != NULL)
-                    new_alpha[ipos] = static_cast<unsigned char> (png_alpha[opos]);
-                ipos++;
-            }
-            opos++;
-        }
-    }
-
-    free(rgb_data);
-    free(png_alpha);
-    rgb_data = new_rgb;
-    if (png_alpha != NULL)
-        png_alpha = new_alpha;
+    pixels = getRow(y) + x;
     width = w;
     height = h;
-    area = w * h;
-
-
 }
 
 /* Center the image in a rectangle of given width and height.
@@ -444,15 +477,7 @@ void Image::Crop(const int x, const int y, const int w, const int h) {
  */
 void Image::Center(const int w, const int h, const char *hex) {
 
-    unsigned long packed_rgb;
-    sscanf(hex, "%lx", &packed_rgb);  
-
-    unsigned long r = packed_rgb>>16;
-    unsigned long g = packed_rgb>>8 & 0xff;
-    unsigned long b = packed_rgb & 0xff;    
-
-    unsigned char *new_rgb = (unsigned char *) malloc(3 * w * h);
-    memset(new_rgb, 0, 3 * w * h);
+    const uint32_t color = hexPixel(hex);
 
     int x = (w - width) / 2;
     int y = (h - height) / 2;
@@ -465,58 +490,34 @@ void Image::Center(const int w, const int h, const char *hex) {
         Crop(0,(height - h)/2,width,h);
         y = 0;
     }
-    int x2 = x + width;
-    int y2 = y + height;
 
-    int ipos = 0;
-    int opos = 0;
-    double tmp;
-
-    area = w * h;
-    for (int i = 0; i < area; i++) {
-        new_rgb[3*i] = r;
-        new_rgb[3*i+1] = g;
-        new_rgb[3*i+2] = b;
-    }
-
-    if (png_alpha != NULL) {
-        for (int j = 0; j < h; j++) {
-            for (int i = 0; i < w; i++) {
-                if (j>=y && i>=x && j<y2 && i<x2) {
-                    ipos = j*w + i;
-                    for (int k = 0; k < 3; k++) {
-                        tmp = rgb_data[3*opos + k]*png_alpha[opos]/255.0
-                              + new_rgb[k]*(1-png_alpha[opos]/255.0);
-                        new_rgb[3*ipos + k] = static_cast<unsigned char> (tmp);
-                    }
-                    opos++;
-                }
+    // opaque and covering the whole rectangle: the crop view is the result
+    if (!has_alpha && width == w && height == h)
+        return;
 
-            }
-        }
-    } else {
-        for (int j = 0; j < h; j++) {
-            for (int i = 0; i < w; i++) {
-                if (j>=y && i>=x && j<y2 && i<x2) {
-                    ipos = j*w + i;
-                    for (int k = 0; k < 3; k++) {
-                        tmp = rgb_data[3*opos + k];
-                        new_rgb[3*ipos + k] = static_cast<unsigned char> (tmp);
-                    }
-                    opos++;
-                }
+    int new_stride;
+    uint32_t *new_pixels = allocPixels(w, h, &new_stride);
+    if (new_pixels == NULL)
+        return;
 
-            }
+    ImageView out(new_pixels, new_stride, w, h);
+    for (int j = 0; j < h; j++)
+        fillRow(out.Row(j), w, color);
+
+    out = out.Sub(x, y, width, height);
+    for (int j = 0; j < height; j++) {
+        uint32_t *row = out.Row(j);
+        const uint32_t *in = getRow(j);
+        if (has_alpha) {
+            for (int i = 0; i < width; i++)
+                row[i] = blendOver(in[i], color);
+        } else {
+            for (int i = 0; i < width; i++)
+                row[i] = in[i] | 0xff000000;
         }
     }
-    
-    free(rgb_data);
-    free(png_alpha);
-    rgb_data = new_rgb;
-    png_alpha = NULL;
-    width = w;
-    height = h;
-    
+
+    setPixels(new_pixels, w, h, new_stride, false);
 }
 
 /* Fill the image with the given color and adjust its dimensions
@@ -524,30 +525,89 @@ void Image::Center(const int w, const int h, const char *hex) {
  */
 void Image::Plain(const int w, const int h, const char *hex) {
 
-    unsigned long packed_rgb;
-    sscanf(hex, "%lx", &packed_rgb);  
+    const uint32_t color = hexPixel(hex);
 
-    unsigned long r = packed_rgb>>16;
-    unsigned long g = packed_rgb>>8 & 0xff;
-    unsigned long b = packed_rgb & 0xff;    
+    int new_stride;
+    uint32_t *new_pixels = allocPixels(w, h, &new_stride);
+    if (new_pixels == NULL)
+        return;
 
-    unsigned char *new_rgb = (unsigned char *) malloc(3 * w * h);
-    memset(new_rgb, 0, 3 * w * h);
+    for (int j = 0; j < h; j++)
+        fillRow((uint32_t *) ((char *) new_pixels + j * new_stride), w, color);
 
-    area = w * h;
-    for (int i = 0; i < area; i++) {
-        new_rgb[3*i] = r;
-        new_rgb[3*i+1] = g;
-        new_rgb[3*i+2] = b;
+    setPixels(new_pixels, w, h, new_stride, false);
+}
+
+Image::BackgroundStyle
+Image::backgroundStyle(const char *name) {
+    if (strcmp(name, "stretch") == 0)
+        return(Background_Stretch);
+    if (strcmp(name, "tile") == 0)
+        return(Background_Tile);
+    return(Background_Center);
+}
+
+/* Render the n pixels starting at (x, y) of the image laid out in the
+ * given style on a w x h area, on top of color. The output is opaque
+ * and matches what Resize(), Tile() or Center() would have produced.
+ */
+void
+Image::renderRow(uint32_t *out, const int x, const int y, const int n,
+                 const int w, const int h, const BackgroundStyle style,
+                 const uint32_t color) const {
+    if (width == 0 || height == 0) {
+        fillRow(out, n, color);
+        return;
     }
 
-    free(rgb_data);
-    free(png_alpha);
-    rgb_data = new_rgb;
-    png_alpha = NULL;
-    width = w;
-    height = h;
-    
+    switch (style) {
+    case Background_Stretch: {
+            const double scale_x = ((double) w) / width;
+            const double scale_y = ((double) h) / height;
+            // sampled at pixel centres like renderPixmap(), so a panel
+            // merged here lines up with a root background from the server
+            const double py = (y + 0.5) / scale_y - 0.5;
+            for (int i = 0; i < n; i++)
+                out[i] = opaquePixel(getPixel((x + i + 0.5) / scale_x - 0.5,
+                                              py));
+        }
+        break;
+    case Background_Tile: {
+            const uint32_t *in = getRow(y % height);
+            int filled = 0;
+            // one period of the source row starting at column x...
+            while (filled < n && filled < width) {
+                const int col = (x + filled) % width;
+                int chunk = width - col;
+                if (chunk > n - filled)
+                    chunk = n - filled;
+                for (int i = 0; i < chunk; i++)
+                    out[filled + i] = opaquePixel(in[col + i]);
+                filled += chunk;
+            }
+            // ...repeated up to n
+            repeatRow(out, filled, n);
+        }
+        break;
+    default: {
+            fillRow(out, n, color);
+
+            // a negative offset crops the image, as Center() does
+            const int sy = y - (h - height) / 2;
+            if (sy < 0 || sy >= height)
+                break;
+            const int dx = (w - width) / 2;
+            const uint32_t *in = getRow(sy);
+            for (int i = 0; i < n; i++) {
+                const int sx = x + i - dx;
+                if (sx < 0 || sx >= width)
+                    continue;
+                out[i] = has_alpha ? blendOver(in[sx], color)
+                                   : in[sx] | 0xff000000;
+            }
+        }
+        break;
+    }
 }
 
 void
@@ -568,136 +628,258 @@ Image::computeShift(unsigned long mask,
     }
 }
 
-Pixmap
-Image::createPixmap(Display* dpy, int scr, Window win) {
-    int i, j;   // loop variables
+static int hostByteOrder() {
+    const uint32_t one = 1;
+    return *(const unsigned char *) &one ? LSBFirst : MSBFirst;
+}
 
-    const int depth = DefaultDepth(dpy, scr);
-    Visual *visual = DefaultVisual(dpy, scr);
-    Colormap colormap = DefaultColormap(dpy, scr);
+/* 4x4 ordered dither thresholds, 0..15 */
+static const unsigned char bayer[16] = {
+     0,  8,  2, 10,
+    12,  4, 14,  6,
+     3, 11,  1,  9,
+    15,  7, 13,  5
+};
+
+/* Nearest colormap entry of each 3-3-2 color. Working it out takes a
+ * query of the whole colormap and 256 x 256 distances, so it is done
+ * once per colormap and shared by every conversion after that.
+ */
+struct ColormapLut {
+    Display *dpy;
+    Colormap colormap;
+    unsigned long pixel[256];
+};
+static ColormapLut *colormap_lut = NULL;
+
+static const unsigned long *pseudoColorLut(Display *dpy, Colormap colormap) {
+    if (colormap_lut && colormap_lut->dpy == dpy
+        && colormap_lut->colormap == colormap)
+        return(colormap_lut->pixel);
+
+    if (colormap_lut == NULL)
+        colormap_lut = new ColormapLut;
+    colormap_lut->dpy = dpy;
+    colormap_lut->colormap = colormap;
+
+    const int num_colors = 256;
+    XColor colors[num_colors];
+    for (int i = 0; i < num_colors; i++)
+        colors[i].pixel = (unsigned long) i;
+    XQueryColors(dpy, colormap, colors, num_colors);
+
+    for (int i = 0; i < num_colors; i++) {
+        const int red = i & 0xe0;           // highest 3 bits
+        const int green = (i & 0x1c) << 3;  // middle 3 bits
+        const int blue = (i & 0x03) << 6;   // lowest 2 bits
+
+        // find the closest color in the colormap
+        int min_distance = 0;
+        for (int ii = 0; ii < num_colors; ii++) {
+            const int dr = (colors[ii].red >> 8) - red;
+            const int dg = (colors[ii].green >> 8) - green;
+            const int db = (colors[ii].blue >> 8) - blue;
+            const int distance = dr * dr + dg * dg + db * db;
+
+            if ((ii == 0) || (distance <= min_distance)) {
+                min_distance = distance;
+                colormap_lut->pixel[i] = colors[ii].pixel;
+            }
+        }
+    }
+    return(colormap_lut->pixel);
+}
 
-    Pixmap tmp = XCreatePixmap(dpy, win, width, height,
-                               depth);
+/* The cache is keyed on the Display pointer and the colormap id, both of
+ * which a connection to a restarted server is likely to get again, with
+ * other colors behind them: it goes when the connection does.
+ */
+void Image::forgetDisplay(Display *dpy) {
+    if (colormap_lut && colormap_lut->dpy == dpy) {
+        delete colormap_lut;
+        colormap_lut = NULL;
+    }
+}
 
-    char *pixmap_data = NULL;
-    switch (depth) {
-    case 32:
-    case 24:
-        pixmap_data = new char[4 * width * height];
-        break;
-    case 16:
-    case 15:
-        pixmap_data = new char[2 * width * height];
+/* Converts 0xAARRGGBB rows to the pixels of a screen's default visual
+ * and stores them in an XImage made for that visual. Below 8 bits per
+ * channel the colors can be ordered dithered, rather than truncated
+ * into bands.
+ */
+class PixelConverter {
+public:
+    PixelConverter(Display* dpy, int scr, const XImage *ximage,
+                   const bool dither);
+    ~PixelConverter();
+
+    // false if the visual class is not supported
+    bool Supported() const {
+        return(supported);
+    };
+    // true if our rows already are in the visual's format
+    bool Direct() const {
+        return(direct);
+    };
+
+    void ConvertRow(XImage *ximage, const int y, const uint32_t *row,
+                    const int n) const;
+
+private:
+    XVisualInfo *visual_info;
+    bool supported;
+    bool direct;
+    bool dithered;
+
+    const unsigned long *lut;   // PseudoColor: 3-3-2 color -> pixel
+
+    unsigned char red_left_shift;
+    unsigned char red_right_shift;
+    unsigned char green_left_shift;
+    unsigned char green_right_shift;
+    unsigned char blue_left_shift;
+    unsigned char blue_right_shift;
+
+    // what the dither adds to each channel, by position in the 4x4 cell
+    unsigned char red_dither[16];
+    unsigned char green_dither[16];
+    unsigned char blue_dither[16];
+};
+
+PixelConverter::PixelConverter(Display* dpy, int scr, const XImage *ximage,
+                               const bool dither)
+    : supported(false), direct(false), dithered(false), lut(NULL) {
+    int entries;
+    XVisualInfo v_template;
+    v_template.visualid = XVisualIDFromVisual(DefaultVisual(dpy, scr));
+    visual_info = XGetVisualInfo(dpy, VisualIDMask, &v_template, &entries);
+    if (visual_info == NULL)
+        return;
+
+    switch (visual_info->c_class) {
+    case PseudoColor:
+        lut = pseudoColorLut(dpy, DefaultColormap(dpy, scr));
+        red_right_shift = 5;
+        green_right_shift = 5;
+        blue_right_shift = 6;
+        supported = true;
         break;
-    case 8:
-        pixmap_data = new char[width * height];
+    case TrueColor:
+        /* Our pixel layout already is what a 24/32 bit TrueColor visual
+         * expects: rows can be handed over as is, the X library takes
+         * care of byte swapping if the server's byte order differs.
+         */
+        direct = ximage->bits_per_pixel == 32
+                 && visual_info->red_mask == 0xff0000
+                 && visual_info->green_mask == 0xff00
+                 && visual_info->blue_mask == 0xff;
+
+        Image::computeShift(visual_info->red_mask, red_left_shift,
+                            red_right_shift);
+        Image::computeShift(visual_info->green_mask, green_left_shift,
+                            green_right_shift);
+        Image::computeShift(visual_info->blue_mask, blue_left_shift,
+                            blue_right_shift);
+        supported = true;
         break;
     default:
-        break;
+        return;
     }
 
-    XImage *ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0,
-                                  pixmap_data, width, height,
-                                  8, 0);
-
-    int entries;
-    XVisualInfo v_template;
-    v_template.visualid = XVisualIDFromVisual(visual);
-    XVisualInfo *visual_info = XGetVisualInfo(dpy, VisualIDMask,
-                               &v_template, &entries);
+    /* Spread what the truncation drops over a 4x4 cell: a channel
+     * keeping 8 - shift bits gets up to one step of 1 << shift added.
+     */
+    dithered = dither && !direct
+               && (red_right_shift || green_right_shift || blue_right_shift);
+    for (int i = 0; i < 16; i++) {
+        red_dither[i] = (bayer[i] << red_right_shift) >> 4;
+        green_dither[i] = (bayer[i] << green_right_shift) >> 4;
+        blue_dither[i] = (bayer[i] << blue_right_shift) >> 4;
+    }
+}
 
-    unsigned long ipos = 0;
-    switch (visual_info->c_class) {
-    case PseudoColor: {
-            XColor xc;
-            xc.flags = DoRed | DoGreen | DoBlue;
-
-            int num_colors = 256;
-            XColor *colors = new XColor[num_colors];
-            for (i = 0; i < num_colors; i++)
-                colors[i].pixel = (unsigned long) i;
-            XQueryColors(dpy, colormap, colors, num_colors);
-
-            int *closest_color = new int[num_colors];
-
-            for (i = 0; i < num_colors; i++) {
-                xc.red = (i & 0xe0) << 8;           // highest 3 bits
-                xc.green = (i & 0x1c) << 11;        // middle 3 bits
-                xc.blue = (i & 0x03) << 14;         // lowest 2 bits
-
-                // find the closest color in the colormap
-                double distance, distance_squared, min_distance = 0;
-                for (int ii = 0; ii < num_colors; ii++) {
-                    distance = colors[ii].red - xc.red;
-                    distance_squared = distance * distance;
-                    distance = colors[ii].green - xc.green;
-                    distance_squared += distance * distance;
-                    distance = colors[ii].blue - xc.blue;
-                    distance_squared += distance * distance;
-
-                    if ((ii == 0) || (distance_squared <= min_distance)) {
-                        min_distance = distance_squared;
-                        closest_color[i] = ii;
-                    }
-                }
-            }
+PixelConverter::~PixelConverter() {
+    if (visual_info)
+        XFree(visual_info);
+}
 
-            for (j = 0; j < height; j++) {
-                for (i = 0; i < width; i++) {
-                    xc.red = (unsigned short) (rgb_data[ipos++] & 0xe0);
-                    xc.green = (unsigned short) (rgb_data[ipos++] & 0xe0);
-                    xc.blue = (unsigned short) (rgb_data[ipos++] & 0xc0);
+static inline unsigned int addClamped(unsigned int value, unsigned int add) {
+    value += add;
+    return(value > 0xff ? 0xff : value);
+}
 
-                    xc.pixel = xc.red | (xc.green >> 3) | (xc.blue >> 6);
-                    XPutPixel(ximage, i, j,
-                              colors[closest_color[xc.pixel]].pixel);
-                }
-            }
-            delete [] colors;
-            delete [] closest_color;
-        }
-        break;
-    case TrueColor: {
-            unsigned char red_left_shift;
-            unsigned char red_right_shift;
-            unsigned char green_left_shift;
-            unsigned char green_right_shift;
-            unsigned char blue_left_shift;
-            unsigned char blue_right_shift;
-
-            computeShift(visual_info->red_mask, red_left_shift,
-                         red_right_shift);
-            computeShift(visual_info->green_mask, green_left_shift,
-                         green_right_shift);
-            computeShift(visual_info->blue_mask, blue_left_shift,
-                         blue_right_shift);
-
-            unsigned long pixel;
-            unsigned long red, green, blue;
-            for (j = 0; j < height; j++) {
-                for (i = 0; i < width; i++) {
-                    red = (unsigned long)
-                          rgb_data[ipos++] >> red_right_shift;
-                    green = (unsigned long)
-                            rgb_data[ipos++] >> green_right_shift;
-                    blue = (unsigned long)
-                           rgb_data[ipos++] >> blue_right_shift;
-
-                    pixel = (((red << red_left_shift) & visual_info->red_mask)
-                             | ((green << green_left_shift)
-                                & visual_info->green_mask)
-                             | ((blue << blue_left_shift)
-                                & visual_info->blue_mask));
-
-                    XPutPixel(ximage, i, j, pixel);
-                }
-            }
+void
+PixelConverter::ConvertRow(XImage *ximage, const int y, const uint32_t *row,
+                           const int n) const {
+    // 8 and 16 bit pixels in our byte order are stored without XPutPixel
+    char *line = ximage->data + y * ximage->bytes_per_line;
+    const int bpp = (ximage->bits_per_pixel == 8
+                     || (ximage->bits_per_pixel == 16
+                         && ximage->byte_order == hostByteOrder()))
+                    ? ximage->bits_per_pixel : 0;
+    const int cell = (y & 3) << 2;
+
+    unsigned long pixel;
+    unsigned int red, green, blue;
+    for (int i = 0; i < n; i++) {
+        red = (row[i] >> 16) & 0xff;
+        green = (row[i] >> 8) & 0xff;
+        blue = row[i] & 0xff;
+        if (dithered) {
+            const int k = cell | (i & 3);
+            red = addClamped(red, red_dither[k]);
+            green = addClamped(green, green_dither[k]);
+            blue = addClamped(blue, blue_dither[k]);
         }
-        break;
-    default: {
-            logStream << "Login.app: could not load image" << endl;
-            return(tmp);
+        red >>= red_right_shift;
+        green >>= green_right_shift;
+        blue >>= blue_right_shift;
+
+        if (lut) {
+            pixel = lut[(red << 5) | (green << 2) | blue];
+        } else {
+            pixel = (((red << red_left_shift) & visual_info->red_mask)
+                     | ((green << green_left_shift)
+                        & visual_info->green_mask)
+                     | ((blue << blue_left_shift)
+                        & visual_info->blue_mask));
         }
+
+        if (bpp == 16)
+            ((uint16_t *) line)[i] = (uint16_t) pixel;
+        else if (bpp == 8)
+            ((unsigned char *) line)[i] = (unsigned char) pixel;
+        else
+            XPutPixel(ximage, i, y, pixel);
+    }
+}
+
+Pixmap
+Image::createPixmap(Display* dpy, int scr, Window win) {
+    const int depth = DefaultDepth(dpy, scr);
+    Visual *visual = DefaultVisual(dpy, scr);
+
+    Pixmap tmp = XCreatePixmap(dpy, win, width, height,
+                               depth);
+
+    XImage *ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0,
+                                  NULL, width, height,
+                                  32, 0);
+
+    PixelConverter converter(dpy, scr, ximage, dither_);
+    if (!converter.Supported()) {
+        logStream << "Login.app: could not load image" << endl;
+        XDestroyImage(ximage);
+        return(tmp);
+    }
+
+    if (converter.Direct()) {
+        ximage->data = (char *) pixels;
+        ximage->bytes_per_line = stride;
+        ximage->byte_order = hostByteOrder();
+    } else {
+        ximage->data = (char *) malloc(ximage->bytes_per_line * height);
+        for (int j = 0; j < height; j++)
+            converter.ConvertRow(ximage, j, getRow(j), width);
     }
 
     GC gc = XCreateGC(dpy, win, 0, NULL);
@@ -705,25 +887,232 @@ Image::createPixmap(Display* dpy, int scr, Window win) {
 
     XFreeGC(dpy, gc);
 
-    XFree(visual_info);
+    if (!converter.Direct())
+        free(ximage->data);
+
+    // Set ximage data to NULL since the pixel data is freed separately
+    ximage->data = NULL;
+    XDestroyImage(ximage);
+
+    return(tmp);
+}
+
+/* Create a w x h pixmap showing the image laid out in the given style.
+ * Rows are resampled, composited over the background color and
+ * converted to the visual's format in one pass, IMAGE_BAND_ROWS at a
+ * time, so only a band of the final picture is ever held in memory.
+ */
+Pixmap
+Image::createPixmap(Display* dpy, int scr, Window win,
+                    const int w, const int h,
+                    const BackgroundStyle style, const char *hex) const {
+    const int depth = DefaultDepth(dpy, scr);
+    Visual *visual = DefaultVisual(dpy, scr);
+    const uint32_t color = hexPixel(hex);
+    const int band = h < IMAGE_BAND_ROWS ? h : IMAGE_BAND_ROWS;
+
+    Pixmap tmp = XCreatePixmap(dpy, win, w, h, depth);
+
+    XImage *ximage = XCreateImage(dpy, visual, depth, ZPixmap, 0,
+                                  NULL, w, band, 32, 0);
+
+    PixelConverter converter(dpy, scr, ximage, dither_);
+    if (!converter.Supported()) {
+        logStream << "Login.app: could not load image" << endl;
+        XDestroyImage(ximage);
+        return(tmp);
+    }
+
+    // direct visuals get rendered straight into the XImage rows
+    int row_stride;
+    uint32_t *rows = allocPixels(w, converter.Direct() ? band : 1,
+                                 &row_stride);
+    if (rows == NULL) {
+        XDestroyImage(ximage);
+        return(tmp);
+    }
+
+    if (converter.Direct()) {
+        ximage->data = (char *) rows;
+        ximage->bytes_per_line = row_stride;
+        ximage->byte_order = hostByteOrder();
+    } else {
+        ximage->data = (char *) malloc(ximage->bytes_per_line * band);
+    }
+
+    ImageView out(rows, row_stride, w, band);
+    GC gc = XCreateGC(dpy, win, 0, NULL);
+    for (int y = 0; y < h; y += band) {
+        const int n = (h - y < band) ? h - y : band;
+        for (int j = 0; j < n; j++) {
+            uint32_t *row = out.Row(converter.Direct() ? j : 0);
+            renderRow(row, 0, y + j, w, w, h, style, color);
+            if (!converter.Direct())
+                converter.ConvertRow(ximage, j, row, w);
+        }
+        XPutImage(dpy, tmp, gc, ximage, 0, 0, 0, y, w, n);
+    }
+    XFreeGC(dpy, gc);
+
+    if (!converter.Direct())
+        free(ximage->data);
+    free(rows);
 
-    delete [] pixmap_data;
+    ximage->data = NULL;
+    XDestroyImage(ximage);
+
+    return(tmp);
+}
 
-    // Set ximage data to NULL since pixmap data was deallocated above
+/* Upload the image as it is into a depth 32 pixmap, for Render to use
+ * as an ARGB32 picture: our pixels already are in that format. With
+ * opaque set, alpha is dropped the way the CPU layouts drop it.
+ */
+Pixmap
+Image::argbPixmap(Display* dpy, Drawable d, const bool opaque) const {
+    uint32_t *data = pixels;
+    int data_stride = stride;
+    if (opaque && has_alpha) {
+        data = allocPixels(width, height, &data_stride);
+        if (data == NULL)
+            return(None);
+        for (int j = 0; j < height; j++) {
+            uint32_t *out = (uint32_t *) ((char *) data + j * data_stride);
+            const uint32_t *in = getRow(j);
+            for (int i = 0; i < width; i++)
+                out[i] = opaquePixel(in[i]);
+        }
+    }
+
+    Pixmap tmp = XCreatePixmap(dpy, d, width, height, 32);
+    XImage *ximage = XCreateImage(dpy, NULL, 32, ZPixmap, 0,
+                                  (char *) data, width, height, 32,
+                                  data_stride);
+    ximage->byte_order = hostByteOrder();
+    GC gc = XCreateGC(dpy, tmp, 0, NULL);
+    XPutImage(dpy, tmp, gc, ximage, 0, 0, 0, 0, width, height);
+    XFreeGC(dpy, gc);
     ximage->data = NULL;
     XDestroyImage(ximage);
+    if (data != pixels)
+        free(data);
+
+    return(tmp);
+}
+
+// Set by RenderError() when a request of renderPixmap() failed
+static bool render_failed = false;
+
+static int RenderError(Display *dpy, XErrorEvent *event) {
+    render_failed = true;
+    return(0);
+}
+
+/* Same as the banded createPixmap(), but done by the X server with the
+ * Render extension: the image is uploaded once at its own size and
+ * scaled (bilinear filter), repeated or centered over the background
+ * color on the server. Returns None if Render can't be used or any of
+ * its requests fails, callers then fall back to createPixmap().
+ */
+Pixmap
+Image::renderPixmap(Display* dpy, int scr, Window win,
+                    const int w, const int h,
+                    const BackgroundStyle style, const char *hex) const {
+    int event_base, error_base;
+    if (!XRenderQueryExtension(dpy, &event_base, &error_base))
+        return(None);
+
+    /* The upload is a depth 32 pixmap, so the source always is ARGB32:
+     * opaque images simply have all alpha bits set.
+     */
+    XRenderPictFormat *dst_format =
+        XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr));
+    XRenderPictFormat *src_format =
+        XRenderFindStandardFormat(dpy, PictStandardARGB32);
+    if (dst_format == NULL || src_format == NULL)
+        return(None);
+
+    // Errors are caught rather than fatal, the CPU path takes over then
+    XSync(dpy, False);
+    render_failed = false;
+    int (*old_handler)(Display *, XErrorEvent *) =
+        XSetErrorHandler(RenderError);
+
+    Pixmap tmp = XCreatePixmap(dpy, win, w, h, DefaultDepth(dpy, scr));
+    Picture dst = XRenderCreatePicture(dpy, tmp, dst_format, 0, NULL);
+
+    const uint32_t pixel = hexPixel(hex);
+    XRenderColor color;
+    color.red = ((pixel >> 16) & 0xff) * 0x101;
+    color.green = ((pixel >> 8) & 0xff) * 0x101;
+    color.blue = (pixel & 0xff) * 0x101;
+    color.alpha = 0xffff;
+    XRenderFillRectangle(dpy, PictOpSrc, dst, &color, 0, 0, w, h);
+
+    if (width > 0 && height > 0) {
+        // stretched and tiled images are made opaque as on the CPU
+        Pixmap src_pixmap = argbPixmap(dpy, win, style != Background_Center);
+
+        XRenderPictureAttributes attr;
+        unsigned long mask = 0;
+        if (style == Background_Tile) {
+            attr.repeat = RepeatNormal;
+            mask |= CPRepeat;
+        } else if (style == Background_Stretch) {
+            attr.repeat = RepeatPad;    // clamp at the edges like getPixel()
+            mask |= CPRepeat;
+        }
+        Picture src = XRenderCreatePicture(dpy, src_pixmap, src_format,
+                                           mask, &attr);
+
+        int src_x = 0, src_y = 0;
+        if (style == Background_Stretch) {
+            XTransform scale = {{
+                { XDoubleToFixed((double) width / w), 0, 0 },
+                { 0, XDoubleToFixed((double) height / h), 0 },
+                { 0, 0, XDoubleToFixed(1.0) }
+            }};
+            XRenderSetPictureTransform(dpy, src, &scale);
+            XRenderSetPictureFilter(dpy, src, FilterBilinear, NULL, 0);
+        } else if (style == Background_Center) {
+            // outside the image the source is transparent and the color shows
+            src_x = -((w - width) / 2);
+            src_y = -((h - height) / 2);
+        }
+
+        /* Stretched and tiled images cover the whole area, only
+         * centered ones go over the color, as with createPixmap().
+         */
+        XRenderComposite(dpy,
+                         style == Background_Center ? PictOpOver : PictOpSrc,
+                         src, None, dst, src_x, src_y, 0, 0, 0, 0, w, h);
+
+        XRenderFreePicture(dpy, src);
+        XFreePixmap(dpy, src_pixmap);
+    }
+    XRenderFreePicture(dpy, dst);
+
+    XSync(dpy, False);
+    if (render_failed) {
+        XFreePixmap(dpy, tmp);
+        XSync(dpy, False);
+        tmp = None;
+    }
+    XSetErrorHandler(old_handler);
 
     return(tmp);
 }
 
 int
-Image::readJpeg(const char *filename, int *width, int *height,
-                unsigned char **rgb)
+Image::readJpeg(const char *filename)
 {
     int ret = 0;
     struct jpeg_decompress_struct cinfo;
     struct jpeg_error_mgr jerr;
-    unsigned char *ptr = NULL;
+    unsigned char *line = NULL;
+    uint32_t *new_pixels = NULL;
+    int new_stride = 0;
+    unsigned int w, h, ncomp;
 
     FILE *infile = fopen(filename, "rb");
     if (infile == NULL) {
@@ -737,60 +1126,56 @@ Image::readJpeg(const char *filename, int *width, int *height,
     jpeg_read_header(&cinfo, TRUE);
     jpeg_start_decompress(&cinfo);
 
+    w = cinfo.output_width;
+    h = cinfo.output_height;
+    ncomp = cinfo.output_components;
+
     /* Prevent against integer overflow */
-    if(cinfo.output_width >= MAX_DIMENSION
-       || cinfo.output_height >= MAX_DIMENSION)
+    if(w >= MAX_DIMENSION || h >= MAX_DIMENSION)
     {
         logStream << APPNAME << "Unreasonable dimension found in file: "
                   << filename << endl;
         goto close_file;
     }
 
-    *width = cinfo.output_width;
-    *height = cinfo.output_height;
+    if (ncomp != 3 && ncomp != 1) {
+        logStream << APPNAME << ": Unsupported JPEG color format in file: "
+                  << filename << endl;
+        goto close_file;
+    }
 
-    rgb[0] = (unsigned char*)
-                malloc(3 * cinfo.output_width * cinfo.output_height);
-    if (rgb[0] == NULL) {
+    new_pixels = allocPixels(w, h, &new_stride);
+    line = (unsigned char*) malloc(ncomp * w);
+    if (new_pixels == NULL || line == NULL) {
         logStream << APPNAME << ": Can't allocate memory for JPEG file."
                   << endl;
-        goto close_file;
+        goto pixels_free;
     }
 
-    if (cinfo.output_components == 3) {
-        ptr = rgb[0];
-        while (cinfo.output_scanline < cinfo.output_height) {
-            jpeg_read_scanlines(&cinfo, &ptr, 1);
-            ptr += 3 * cinfo.output_width;
-        }
-    } else if (cinfo.output_components == 1) {
-        ptr = (unsigned char*) malloc(cinfo.output_width);
-        if (ptr == NULL) {
-            logStream << APPNAME << ": Can't allocate memory for JPEG file."
-                      << endl;
-            goto rgb_free;
-        }
-
-        unsigned int ipos = 0;
-        while (cinfo.output_scanline < cinfo.output_height) {
-            jpeg_read_scanlines(&cinfo, &ptr, 1);
-
-            for (unsigned int i = 0; i < cinfo.output_width; i++) {
-                memset(rgb[0] + ipos, ptr[i], 3);
-                ipos += 3;
-            }
+    while (cinfo.output_scanline < h) {
+        uint32_t *row = (uint32_t *) ((char *) new_pixels
+                        + cinfo.output_scanline * new_stride);
+        jpeg_read_scanlines(&cinfo, &line, 1);
+
+        if (ncomp == 3) {
+            const unsigned char *p = line;
+            for (unsigned int i = 0; i < w; i++, p += 3)
+                row[i] = 0xff000000 | (p[0] << 16) | (p[1] << 8) | p[2];
+        } else {
+            for (unsigned int i = 0; i < w; i++)
+                row[i] = 0xff000000 | (line[i] * 0x010101);
         }
-
-        free(ptr);
     }
 
     jpeg_finish_decompress(&cinfo);
 
+    setPixels(new_pixels, w, h, new_stride, false);
+    new_pixels = NULL;
     ret = 1;
-    goto close_file;
 
-rgb_free:
-    free(rgb[0]);
+pixels_free:
+    free(line);
+    free(new_pixels);
 
 close_file:
     jpeg_destroy_decompress(&cinfo);
@@ -800,16 +1185,18 @@ close_file:
 }
 
 int
-Image::readPng(const char *filename, int *width, int *height,
-               unsigned char **rgb, unsigned char **alpha)
+Image::readPng(const char *filename)
 {
     int ret = 0;
 
     png_structp png_ptr;
-    png_infop info_ptr;
-    png_bytepp row_pointers;
+    png_infop info_ptr = NULL;
+    /* volatile: both are changed after setjmp() and freed after a longjmp */
+    png_bytepp volatile row_pointers = NULL;
 
-    unsigned char *ptr = NULL;
+    uint32_t * volatile new_pixels = NULL;
+    int new_stride = 0;
+    bool alpha;
     png_uint_32 w, h;
     int bit_depth, color_type, interlace_type;
     int i;
@@ -832,6 +1219,7 @@ Image::readPng(const char *filename, int *width, int *height,
     if (!info_ptr) {
         png_destroy_read_struct(&png_ptr, (png_infopp) NULL,
                                 (png_infopp) NULL);
+        goto file_close;
     }
 
 #if PNG_LIBPNG_VER_MAJOR >= 1 && PNG_LIBPNG_VER_MINOR >= 4
@@ -839,7 +1227,7 @@ Image::readPng(const char *filename, int *width, int *height,
 #else
     if (setjmp(png_ptr->jmpbuf)) {
 #endif
-        goto png_destroy;
+        goto rows_free;
     }
 
     png_init_io(png_ptr, infile);
@@ -855,21 +1243,6 @@ Image::readPng(const char *filename, int *width, int *height,
         goto png_destroy;
     }
 
-    *width = (int) w;
-    *height = (int) h;
-
-    if (color_type == PNG_COLOR_TYPE_RGB_ALPHA
-        || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-    {
-        alpha[0] = (unsigned char *) malloc(*width * *height);
-        if (alpha[0] == NULL) {
-            logStream << APPNAME
-                    << ": Can't allocate memory for alpha channel in PNG file."
-                    << endl;
-            goto png_destroy;
-        }
-    }
-
     /* Change a paletted/grayscale image to RGB */
     if (color_type == PNG_COLOR_TYPE_PALETTE && bit_depth <= 8)
     {
@@ -880,9 +1253,16 @@ Image::readPng(const char *filename, int *width, int *height,
     if (color_type == PNG_COLOR_TYPE_GRAY
         || color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
     {
+        if (bit_depth < 8)
+            png_set_expand(png_ptr);
         png_set_gray_to_rgb(png_ptr);
     }
 
+    /* Turn a transparency chunk into a real alpha channel */
+    if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png_ptr);
+    }
+
     /* If the PNG file has 16 bits per channel, strip them down to 8 */
     if (bit_depth == 16) {
       png_set_strip_16(png_ptr);
@@ -891,58 +1271,42 @@ Image::readPng(const char *filename, int *width, int *height,
     /* use 1 byte per pixel */
     png_set_packing(png_ptr);
 
-    row_pointers = (png_byte **) malloc(*height * sizeof(png_bytep));
-    if (row_pointers == NULL) {
-        logStream << APPNAME << ": Can't allocate memory for PNG file." << endl;
-        goto png_destroy;
-    }
-
-    for (i = 0; i < *height; i++) {
-        row_pointers[i] = (png_byte*) malloc(4 * *width);
-        if (row_pointers == NULL) {
-            logStream << APPNAME << ": Can't allocate memory for PNG file."
-                      << endl;
-            goto rows_free;
-        }
-    }
+    /* always read 4 bytes per pixel, opaque if there is no alpha */
+    png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
 
-    png_read_image(png_ptr, row_pointers);
+    png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+    alpha = (png_get_color_type(png_ptr, info_ptr) & PNG_COLOR_MASK_ALPHA)
+            || png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS);
 
-    rgb[0] = (unsigned char *) malloc(3 * (*width) * (*height));
-    if (rgb[0] == NULL) {
+    new_pixels = allocPixels(w, h, &new_stride);
+    row_pointers = (png_byte **) malloc(h * sizeof(png_bytep));
+    if (new_pixels == NULL || row_pointers == NULL) {
         logStream << APPNAME << ": Can't allocate memory for PNG file." << endl;
         goto rows_free;
     }
 
-    if (alpha[0] == NULL) {
-        ptr = rgb[0];
-        for (i = 0; i < *height; i++) {
-            memcpy(ptr, row_pointers[i], 3 * (*width));
-            ptr += 3 * (*width);
-        }
-    } else {
-        ptr = rgb[0];
-        for (i = 0; i < *height; i++) {
-            unsigned int ipos = 0;
-            for (int j = 0; j < *width; j++) {
-                *ptr++ = row_pointers[i][ipos++];
-                *ptr++ = row_pointers[i][ipos++];
-                *ptr++ = row_pointers[i][ipos++];
-                alpha[0][i * (*width) + j] = row_pointers[i][ipos++];
-            }
-        }
+    /* decode straight into the pixel buffer: RGBA bytes are turned
+     * into premultiplied pixels in place afterwards */
+    for (i = 0; i < (int) h; i++)
+        row_pointers[i] = (png_byte*) new_pixels + i * new_stride;
+
+    png_read_image(png_ptr, row_pointers);
+
+    for (i = 0; i < (int) h; i++) {
+        uint32_t *row = (uint32_t *) row_pointers[i];
+        const unsigned char *p = row_pointers[i];
+        for (png_uint_32 j = 0; j < w; j++, p += 4)
+            row[j] = packPixel(p[0], p[1], p[2], p[3]);
     }
 
+    setPixels(new_pixels, w, h, new_stride, alpha);
+    new_pixels = NULL;
     ret = 1; /* data reading is OK */
 
 rows_free:
-    for (i = 0; i < *height; i++) {
-        if (row_pointers[i] != NULL ) {
-            free(row_pointers[i]);
-        }
-    }
-
     free(row_pointers);
+    free(new_pixels);
 
 png_destroy:
     png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp) NULL);
@@ -15,28 +15,73 @@
 #ifndef _IMAGE_H_
 #define _IMAGE_H_
 
+#include <stdint.h>
 #include <X11/Xlib.h>
 #include <X11/Xmu/WinUtil.h>
 #include "log.h"
 
+/* Pixels are stored as native-endian 32-bit 0xAARRGGBB words with
+ * premultiplied alpha (XRGB with alpha 0xff for opaque images). Rows
+ * start every Stride() bytes and are padded to IMAGE_ROW_ALIGN, so
+ * they can be handed to an XImage or copied with aligned block moves.
+ */
+#define IMAGE_ROW_ALIGN 32
+
+/* A rectangular window into a pixel buffer: pointer to the top-left
+ * pixel plus the row stride in bytes. Views do not own their pixels,
+ * so taking a sub-view is O(1).
+ */
+struct ImageView {
+    uint32_t *data;
+    int stride;
+    int width;
+    int height;
+
+    ImageView() : data(NULL), stride(0), width(0), height(0) {};
+    ImageView(uint32_t *d, int s, int w, int h) :
+              data(d), stride(s), width(w), height(h) {};
+
+    uint32_t *Row(const int y) const {
+        return (uint32_t *) ((char *) data + y * stride);
+    };
+    ImageView Sub(const int x, const int y, const int w, const int h) const {
+        return ImageView(Row(y) + x, stride, w, h);
+    };
+};
+
 class Image {
 public:
+    /* How a background image is laid out on a larger (or smaller) area */
+    enum BackgroundStyle {
+        Background_Stretch,
+        Background_Tile,
+        Background_Center   // also used for plain color backgrounds
+    };
+
     Image();
     Image(const int w, const int h, const unsigned char *rgb,
           const unsigned char *alpha);
+    Image(const Image& image);
 
     ~Image();
 
-    const unsigned char * getPNGAlpha() const {
-        return(png_alpha);
+    const uint32_t * getPixels() const {
+        return(pixels);
     };
-    const unsigned char * getRGBData() const {
-        return(rgb_data);
+    const uint32_t * getRow(const int y) const {
+        return((const uint32_t *) ((const char *) pixels + y * stride));
+    };
+    uint32_t * getRow(const int y) {
+        return((uint32_t *) ((char *) pixels + y * stride));
+    };
+    bool hasAlpha() const {
+        return(has_alpha);
+    };
+    ImageView View() const {
+        return(ImageView(pixels, stride, width, height));
     };
 
-    void getPixel(double px, double py, unsigned char *pixel);
-    void getPixel(double px, double py, unsigned char *pixel,
-                  unsigned char *alpha);
+    uint32_t getPixel(double px, double py) const;
 
     int Width() const  {
         return(width);
@@ -44,9 +89,16 @@ public:
     int Height() const {
         return(height);
     };
+    int Stride() const {
+        return(stride);
+    };
     void Quality(const int q) {
         quality_ = q;
     };
+    // Ordered dither when converting to visuals below 8 bits per channel
+    void Dither(const bool d) {
+        dither_ = d;
+    };
 
     bool Read(const char *filename);
 
@@ -58,23 +110,46 @@ public:
     void Tile(const int w, const int h);
     void Center(const int w, const int h, const char *hex);
     void Plain(const int w, const int h, const char *hex);
-    
-    void computeShift(unsigned long mask, unsigned char &left_shift,
-                      unsigned char &right_shift);
+    void Merge(const Image* background, const int x, const int y,
+               const int w, const int h, const BackgroundStyle style,
+               const char *hex);
+
+    static void computeShift(unsigned long mask, unsigned char &left_shift,
+                             unsigned char &right_shift);
+    static BackgroundStyle backgroundStyle(const char *name);
+    // Drop what is cached for dpy; call before closing it
+    static void forgetDisplay(Display *dpy);
 
     Pixmap createPixmap(Display* dpy, int scr, Window win);
+    Pixmap createPixmap(Display* dpy, int scr, Window win,
+                        const int w, const int h,
+                        const BackgroundStyle style, const char *hex) const;
+    Pixmap renderPixmap(Display* dpy, int scr, Window win,
+                        const int w, const int h,
+                        const BackgroundStyle style, const char *hex) const;
+    Pixmap argbPixmap(Display* dpy, Drawable d, const bool opaque = false) const;
 
 private:
-    int width, height, area;
-    unsigned char *rgb_data;
-    unsigned char *png_alpha;
+    Image& operator=(const Image&);
+
+    int width, height, stride;
+    uint32_t *buffer;   // allocation, owned
+    uint32_t *pixels;   // top-left pixel of the image inside buffer
+    bool has_alpha;
 
     int quality_;
+    bool dither_;
+
+    static uint32_t *allocPixels(const int w, const int h, int *stride);
+    void setPixels(uint32_t *data, const int w, const int h,
+                   const int new_stride, const bool alpha);
+
+    void renderRow(uint32_t *out, const int x, const int y, const int n,
+                   const int w, const int h, const BackgroundStyle style,
+                   const uint32_t color) const;
 
-    int readJpeg(const char *filename, int *width, int *height,
-        unsigned char **rgb);
-    int readPng(const char *filename, int *width, int *height,
-        unsigned char **rgb, unsigned char **alpha);
+    int readJpeg(const char *filename);
+    int readPng(const char *filename);
 };
 
 #endif
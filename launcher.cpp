@@ -0,0 +1,418 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "launcher.h"
+
+extern char** environ;
+
+using namespace std;
+
+// Characters which make us hand the command line over to /bin/sh
+static const char* ShellChars = "|&;<>()$`*?[]{}~#\n";
+
+// Builtins and reserved words: only the shell knows what to do with these
+static const char* ShellWords[] = {
+    "!", ".", ":", "[[", "]]", "alias", "bg", "break", "case", "cd",
+    "command", "continue", "do", "done", "elif", "else", "esac", "eval",
+    "exec", "exit", "export", "fc", "fg", "fi", "for", "function",
+    "getopts", "hash", "if", "in", "jobs", "local", "read", "readonly",
+    "return", "select", "set", "shift", "source", "then", "time", "times",
+    "trap", "type", "ulimit", "umask", "unalias", "unset", "until", "wait",
+    "while", NULL
+};
+
+static long NowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+Launcher::Launcher(const string& cmd, ShellMode shell_mode)
+    : command(cmd), shell(shell_mode), environment(environ),
+      timeout(0), capture(false), pid(-1), outfd(-1)
+{
+}
+
+Launcher::~Launcher() {
+    if (outfd >= 0)
+        close(outfd);
+    if (pid > 0)
+        Wait();
+}
+
+void Launcher::SetEnvironment(char** env) {
+    environment = env ? env : environ;
+}
+
+// Kill the command if it is still running msec after Start(); 0 waits forever
+void Launcher::SetTimeout(int msec) {
+    timeout = msec;
+}
+
+void Launcher::SetCapture(bool enable) {
+    capture = enable;
+}
+
+pid_t Launcher::GetPid() const {
+    return pid;
+}
+
+const string& Launcher::GetOutput() const {
+    return output;
+}
+
+/*
+ * Split a command line into words, honouring '', "" and backslash
+ * quoting. Returns false if the line uses any other shell syntax
+ * (pipes, redirections, globs, substitutions, VAR=value prefixes,
+ * several lines, builtins...), in which case it has to go through /bin/sh.
+ */
+bool Launcher::Split(const string& cmd, vector<string>& argv) {
+    string word;
+    bool inword = false;
+    char quote = 0;
+
+    argv.clear();
+    for (string::size_type i = 0; i < cmd.length(); i++) {
+        char c = cmd[i];
+
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && i + 1 < cmd.length()
+                       && strchr("\\\"$`", cmd[i+1])) {
+                word += cmd[++i];
+            } else if (quote == '"' && (c == '$' || c == '`')) {
+                return false;
+            } else {
+                word += c;
+            }
+            continue;
+        }
+
+        if (c == ' ' || c == '\t') {
+            if (inword) {
+                argv.push_back(word);
+                word.clear();
+                inword = false;
+            }
+            continue;
+        }
+
+        if (strchr(ShellChars, c))
+            return false;
+        if (c == '=' && argv.empty())
+            return false;
+
+        inword = true;
+        if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '\\') {
+            if (++i == cmd.length())
+                return false;
+            word += cmd[i];
+        } else {
+            word += c;
+        }
+    }
+
+    if (quote)
+        return false;
+    if (inword)
+        argv.push_back(word);
+    if (argv.empty())
+        return false;
+    for (const char** w = ShellWords; *w; w++) {
+        if (argv[0] == *w)
+            return false;
+    }
+    return true;
+}
+
+bool Launcher::Start() {
+    vector<string> words;
+    bool use_shell = (shell == Shell_Always);
+
+    if (!use_shell && !Split(command, words)) {
+        if (shell == Shell_Never)
+            return false;
+        use_shell = true;
+    }
+    if (use_shell) {
+        words.clear();
+        words.push_back("/bin/sh");
+        words.push_back("-c");
+        words.push_back(command);
+    }
+
+    vector<char*> argv;
+    for (vector<string>::iterator it = words.begin(); it != words.end(); ++it)
+        argv.push_back(const_cast<char*>(it->c_str()));
+    argv.push_back(NULL);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    int pipefd[2] = { -1, -1 };
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawnattr_init(&attr);
+
+    // Children start with an empty signal mask and default SIGPIPE,
+    // SIGINT and SIGQUIT (Run() ignores the latter two meanwhile)
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    if (capture) {
+        if (pipe(pipefd) != 0) {
+            posix_spawnattr_destroy(&attr);
+            posix_spawn_file_actions_destroy(&actions);
+            return false;
+        }
+        fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+        fcntl(pipefd[0], F_SETFL, O_NONBLOCK);
+        posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, pipefd[1]);
+    }
+
+    int ret = posix_spawnp(&pid, argv[0], &actions, &attr,
+                           &argv[0], environment);
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (capture) {
+        close(pipefd[1]);
+        outfd = pipefd[0];
+    }
+
+    if (ret != 0) {
+        pid = -1;
+        if (outfd >= 0) {
+            close(outfd);
+            outfd = -1;
+        }
+        errno = ret;
+        return false;
+    }
+    return true;
+}
+
+// Drain the child's stdout until EOF or until msec elapsed (msec <= 0: no limit)
+void Launcher::ReadOutput(int msec) {
+    long deadline = NowMs() + msec;
+    char buffer[512];
+
+    while (outfd >= 0) {
+        ssize_t n = read(outfd, buffer, sizeof(buffer));
+        if (n > 0) {
+            output.append(buffer, n);
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            break;
+
+        int wait_ms = -1;
+        if (msec > 0) {
+            wait_ms = deadline - NowMs();
+            if (wait_ms <= 0)
+                return;
+        }
+        struct pollfd pfd;
+        pfd.fd = outfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, wait_ms) < 0 && errno != EINTR)
+            break;
+    }
+
+    close(outfd);
+    outfd = -1;
+}
+
+/*
+ * Block until the child exits or msec elapsed. Waits on a pidfd where
+ * the kernel has them, otherwise in sigtimedwait() for SIGCHLD, blocked
+ * in this thread meanwhile: an exit after the first waitpid() below
+ * stays pending for it. Should another thread take the signal, the wait
+ * runs into the deadline and the last waitpid() still sees the exit.
+ * Returns the waitpid() result, 0 if the child is still running.
+ */
+static pid_t WaitTimed(pid_t pid, int* status, int msec) {
+    long deadline = NowMs() + msec;
+
+#ifdef SYS_pidfd_open
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) {
+        struct pollfd pfd;
+        pfd.fd = pidfd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        while (poll(&pfd, 1, msec) < 0 && errno == EINTR) {
+            msec = deadline - NowMs();
+            if (msec < 0)
+                msec = 0;
+        }
+        close(pidfd);
+        return waitpid(pid, status, WNOHANG);
+    }
+#endif
+
+    sigset_t chld, oldmask;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld, &oldmask);
+
+    pid_t ret;
+    while ((ret = waitpid(pid, status, WNOHANG)) == 0) {
+        long left = deadline - NowMs();
+        if (left <= 0)
+            break;
+        struct timespec ts;
+        ts.tv_sec = left / 1000;
+        ts.tv_nsec = (left % 1000) * 1000000L;
+        if (sigtimedwait(&chld, NULL, &ts) < 0 && errno != EINTR)
+            ret = waitpid(pid, status, WNOHANG); // EAGAIN: deadline
+        if (ret != 0)
+            break;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    return ret;
+}
+
+// Wait for the child, killing it once msec elapsed (msec <= 0: no limit)
+int Launcher::Reap(int msec) {
+    int status = WaitFor(pid, msec);
+    pid = -1;
+    return status;
+}
+
+/* Reap child, also one not started by a Launcher, killing it once msec
+ * elapsed (msec <= 0: no limit). Returns the exit status, or -1 if it
+ * could not be waited for, was killed by a signal or ran into the timeout.
+ */
+int Launcher::WaitFor(pid_t child, int msec) {
+    int status;
+    pid_t ret;
+
+    if (child <= 0)
+        return -1;
+    if (msec > 0) {
+        ret = WaitTimed(child, &status, msec);
+        if (ret == 0)
+            kill(child, SIGKILL);
+    } else {
+        ret = 0;
+    }
+    while (ret == 0 || (ret < 0 && errno == EINTR))
+        ret = waitpid(child, &status, 0);
+
+    if (ret < 0)
+        return -1;
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    return -1;
+}
+
+/*
+ * Wait for the command to finish, collecting its output if capture was
+ * requested. Returns the exit status, or -1 if the command could not be
+ * waited for, was killed by a signal or ran into the timeout.
+ */
+int Launcher::Wait() {
+    if (pid <= 0)
+        return -1;
+
+    long start = NowMs();
+    if (outfd >= 0) {
+        ReadOutput(timeout);
+        if (outfd >= 0) {
+            // timed out while reading
+            close(outfd);
+            outfd = -1;
+            kill(pid, SIGKILL);
+        }
+    }
+
+    int left = 0;
+    if (timeout > 0) {
+        left = timeout - (NowMs() - start);
+        if (left <= 0)
+            left = 1;
+    }
+    return Reap(left);
+}
+
+/* Like system(), SIGINT and SIGQUIT are ignored and SIGCHLD is blocked
+ * while the command runs: a ^C meant for it doesn't end the caller, and
+ * the caller's own SIGCHLD handling doesn't reap it behind our back.
+ */
+int Launcher::Run(const string& cmd, int msec) {
+    struct sigaction ignore, oldint, oldquit;
+    sigset_t chld, oldmask;
+
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGINT, &ignore, &oldint);
+    sigaction(SIGQUIT, &ignore, &oldquit);
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &chld, &oldmask);
+
+    int status = -1;
+    {
+        Launcher launcher(cmd);
+        launcher.SetTimeout(msec);
+        if (launcher.Start())
+            status = launcher.Wait();
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGQUIT, &oldquit, NULL);
+    return status;
+}
+
+pid_t Launcher::Spawn(const string& cmd) {
+    Launcher launcher(cmd);
+    if (!launcher.Start())
+        return -1;
+    pid_t child = launcher.pid;
+    launcher.pid = -1; // don't wait for it when going out of scope
+    return child;
+}
+
+string Launcher::Capture(const string& cmd, int msec) {
+    Launcher launcher(cmd);
+    launcher.SetTimeout(msec);
+    launcher.SetCapture(true);
+    if (!launcher.Start())
+        return "";
+    launcher.Wait();
+    return launcher.GetOutput();
+}
@@ -0,0 +1,71 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _LAUNCHER_H_
+#define _LAUNCHER_H_
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+/*
+ * Runs external commands with posix_spawn() instead of system()/popen(),
+ * so the (large) greeter address space is never duplicated and no
+ * /bin/sh is started unless the command line actually needs one.
+ */
+class Launcher {
+public:
+    enum ShellMode {
+        Shell_Auto,     // use /bin/sh only for shell syntax
+        Shell_Always,
+        Shell_Never
+    };
+
+    Launcher(const std::string& cmd, ShellMode shell_mode = Shell_Auto);
+    ~Launcher();
+
+    void SetEnvironment(char** env);
+    void SetTimeout(int msec);
+    void SetCapture(bool enable);
+
+    bool Start();
+    int Wait();
+    pid_t GetPid() const;
+    const std::string& GetOutput() const;
+
+    // system() replacement: run and wait, returns the exit status or -1
+    static int Run(const std::string& cmd, int msec = 0);
+    // popen() replacement: run and return what the command printed
+    static std::string Capture(const std::string& cmd, int msec = 0);
+    // start in the background, the caller reaps the returned pid
+    static pid_t Spawn(const std::string& cmd);
+    // reap a child, killing it once msec elapsed; exit status or -1
+    static int WaitFor(pid_t child, int msec);
+
+    static bool Split(const std::string& cmd, std::vector<std::string>& argv);
+
+private:
+    Launcher();
+    Launcher(const Launcher&);
+    Launcher& operator=(const Launcher&);
+
+    void ReadOutput(int msec);
+    int Reap(int msec);
+
+    std::string command;
+    ShellMode shell;
+    char** environment;
+    int timeout;
+    bool capture;
+
+    pid_t pid;
+    int outfd;
+    std::string output;
+};
+
+#endif
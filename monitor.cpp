@@ -0,0 +1,170 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <stdlib.h>
+#include <X11/Xlib-xcb.h>
+#include <X11/extensions/Xrandr.h>
+#include <xcb/randr.h>
+
+#include "monitor.h"
+
+using namespace std;
+
+// Add rect to monitors unless a clone is there already; its index
+static int Add(vector<Rectangle>& monitors, const Rectangle& rect) {
+    vector<Rectangle>::size_type i;
+    for (i = 0; i < monitors.size(); i++) {
+        if (monitors[i] == rect)
+            return i;
+    }
+    monitors.push_back(rect);
+    return i;
+}
+
+// RandR 1.5: the server hands out all monitors in a single reply
+static void ActiveMonitors(Display* dpy, Window root,
+                           vector<Rectangle>& monitors, int *primary) {
+    int count = 0;
+    XRRMonitorInfo *info = XRRGetMonitors(dpy, root, True, &count);
+
+    for (int i = 0; info && i < count; i++) {
+        Rectangle rect(info[i].x, info[i].y, info[i].width, info[i].height);
+        if (rect.is_empty())
+            continue;
+        int j = Add(monitors, rect);
+        if (info[i].primary)
+            *primary = j;
+    }
+    if (info)
+        XRRFreeMonitors(info);
+}
+
+/* RandR 1.3: walk the CRTCs. The current resources are what the server
+ * knows already, getting them doesn't have it probe the outputs. The
+ * requests go out through XCB, all CRTCs before the first reply is
+ * read: two round trips whatever the number of CRTCs.
+ */
+static void CrtcMonitors(Display* dpy, Window root,
+                         vector<Rectangle>& monitors, int *primary) {
+    xcb_connection_t* conn = XGetXCBConnection(dpy);
+    xcb_randr_get_screen_resources_current_cookie_t resources_cookie =
+        xcb_randr_get_screen_resources_current(conn, root);
+    xcb_randr_get_output_primary_cookie_t primary_cookie =
+        xcb_randr_get_output_primary(conn, root);
+
+    xcb_randr_get_screen_resources_current_reply_t* resources =
+        xcb_randr_get_screen_resources_current_reply(conn, resources_cookie,
+                                                     NULL);
+    xcb_randr_get_output_primary_reply_t* primary_reply =
+        xcb_randr_get_output_primary_reply(conn, primary_cookie, NULL);
+    xcb_randr_output_t primary_output = XCB_NONE;
+    if (primary_reply) {
+        primary_output = primary_reply->output;
+        free(primary_reply);
+    }
+    if (!resources)
+        return;
+
+    xcb_randr_crtc_t* crtcs =
+        xcb_randr_get_screen_resources_current_crtcs(resources);
+    int ncrtc = xcb_randr_get_screen_resources_current_crtcs_length(resources);
+    vector<xcb_randr_get_crtc_info_cookie_t> cookies(ncrtc);
+    for (int i = 0; i < ncrtc; i++)
+        cookies[i] = xcb_randr_get_crtc_info(conn, crtcs[i],
+                                             resources->config_timestamp);
+
+    for (int i = 0; i < ncrtc; i++) {
+        xcb_randr_get_crtc_info_reply_t* crtc_info =
+            xcb_randr_get_crtc_info_reply(conn, cookies[i], NULL);
+        if (!crtc_info)
+            continue;
+
+        Rectangle rect(crtc_info->x, crtc_info->y,
+                       crtc_info->width, crtc_info->height);
+        bool enabled = crtc_info->mode != XCB_NONE
+                       && crtc_info->num_outputs > 0 && !rect.is_empty();
+
+        // the primary output is one of those the CRTC drives
+        bool is_primary = false;
+        xcb_randr_output_t* outputs = xcb_randr_get_crtc_info_outputs(crtc_info);
+        int noutput = xcb_randr_get_crtc_info_outputs_length(crtc_info);
+        for (int k = 0; primary_output != XCB_NONE && k < noutput; k++) {
+            if (outputs[k] == primary_output)
+                is_primary = true;
+        }
+        free(crtc_info);
+        if (!enabled)
+            continue;
+
+        // clones show the same area, keep a single copy
+        int j = Add(monitors, rect);
+        if (is_primary)
+            *primary = j;
+    }
+    free(resources);
+}
+
+vector<Rectangle> Monitor::List(Display* dpy, int scr, Window root,
+                                int *primary) {
+    vector<Rectangle> monitors;
+    int event_base, error_base;
+    int major, minor;
+
+    *primary = -1;
+
+    // The version is only asked for once per display, Xrandr keeps it
+    if (root == RootWindow(dpy, scr)
+        && XRRQueryExtension(dpy, &event_base, &error_base)
+        && XRRQueryVersion(dpy, &major, &minor)) {
+        if (major > 1 || (major == 1 && minor >= 5))
+            ActiveMonitors(dpy, root, monitors, primary);
+        else
+            CrtcMonitors(dpy, root, monitors, primary);
+    }
+
+    if (monitors.empty()) {
+        Window root_return;
+        int x, y;
+        unsigned int width, height, border, depth;
+        XGetGeometry(dpy, root, &root_return, &x, &y,
+                     &width, &height, &border, &depth);
+        *primary = -1;
+        monitors.push_back(Rectangle(0, 0, width, height));
+    }
+
+    return monitors;
+}
+
+int Monitor::Pointer(Display* dpy, Window root,
+                     const vector<Rectangle>& monitors) {
+    Window root_return, child;
+    int x, y, win_x, win_y;
+    unsigned int mask;
+
+    if (!XQueryPointer(dpy, root, &root_return, &child, &x, &y,
+                       &win_x, &win_y, &mask))
+        return -1;
+
+    for (vector<Rectangle>::size_type i = 0; i < monitors.size(); i++) {
+        if (monitors[i].contains(win_x, win_y))
+            return i;
+    }
+    return -1;
+}
+
+int Monitor::Preferred(Display* dpy, Window root,
+                       const vector<Rectangle>& monitors, int primary) {
+    if (primary >= 0)
+        return primary;
+    if (monitors.size() > 1) {
+        int pointer = Pointer(dpy, root, monitors);
+        if (pointer >= 0)
+            return pointer;
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _MONITOR_H_
+#define _MONITOR_H_
+
+#include <X11/Xlib.h>
+#include <vector>
+
+struct Rectangle {
+    int x;
+    int y;
+    unsigned int width;
+    unsigned int height;
+
+    Rectangle() : x(0), y(0), width(0), height(0) {};
+    Rectangle(int x, int y, unsigned int width, unsigned int height) :
+              x(x), y(y), width(width), height(height) {};
+    bool is_empty() const {
+            return width == 0 || height == 0;
+    }
+    bool contains(int px, int py) const {
+            return px >= x && py >= y
+                   && px < x + (int) width && py < y + (int) height;
+    }
+    // Smallest rectangle covering both
+    Rectangle united(const Rectangle& r) const {
+            if (is_empty())
+                return r;
+            if (r.is_empty())
+                return *this;
+            int x1 = x < r.x ? x : r.x;
+            int y1 = y < r.y ? y : r.y;
+            int x2 = x + (int) width > r.x + (int) r.width
+                     ? x + (int) width : r.x + (int) r.width;
+            int y2 = y + (int) height > r.y + (int) r.height
+                     ? y + (int) height : r.y + (int) r.height;
+            return Rectangle(x1, y1, x2 - x1, y2 - y1);
+    }
+    // Part covered by both, empty if they don't overlap
+    Rectangle intersected(const Rectangle& r) const {
+            int x1 = x > r.x ? x : r.x;
+            int y1 = y > r.y ? y : r.y;
+            int x2 = x + (int) width < r.x + (int) r.width
+                     ? x + (int) width : r.x + (int) r.width;
+            int y2 = y + (int) height < r.y + (int) r.height
+                     ? y + (int) height : r.y + (int) r.height;
+            if (x2 <= x1 || y2 <= y1)
+                return Rectangle();
+            return Rectangle(x1, y1, x2 - x1, y2 - y1);
+    }
+    bool operator==(const Rectangle& r) const {
+            return x == r.x && y == r.y
+                   && width == r.width && height == r.height;
+    }
+    bool operator!=(const Rectangle& r) const {
+            return !(*this == r);
+    }
+};
+
+/*
+ * The monitors (XRandR monitors, or enabled CRTCs before RandR 1.5)
+ * showing parts of a screen.
+ * Without RandR, or when drawing into a window instead of the root
+ * (theme testing), the whole drawable is a single monitor.
+ */
+namespace Monitor {
+    // Never empty; *primary is the primary monitor or -1 if none is set
+    std::vector<Rectangle> List(Display* dpy, int scr, Window root,
+                                int *primary);
+    // Index of the monitor containing the pointer, -1 if unknown
+    int Pointer(Display* dpy, Window root,
+                const std::vector<Rectangle>& monitors);
+    // Primary monitor, else the one under the pointer, else the first
+    int Preferred(Display* dpy, Window root,
+                  const std::vector<Rectangle>& monitors, int primary);
+};
+
+#endif /* _MONITOR_H_ */
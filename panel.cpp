@@ -11,20 +11,44 @@
 
 #include <cstdio>
 #include <iostream>
-#include <memory>
-#include <stdexcept>
 #include <string>
-#include <array>
 #include <chrono>
 #include <sstream>
+#include <algorithm>
+#include <climits>
 #include <poll.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <X11/extensions/Xrandr.h>
 #include "panel.h"
+#include "launcher.h"
 
 using namespace std;
 
-Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& themedir, PanelType panel_mode)
+// Options naming the fonts a theme draws with
+static const char* FontOptions[] = {
+    "input_font", "welcome_font", "intro_font", "username_font",
+    "msg_font", "text_widget_font", "session_font", NULL
+};
+
+// Options holding the messages a theme may draw
+static const char* MessageOptions[] = {
+    "intro_msg", "username_msg", "password_msg", "passwd_feedback_msg",
+    "session_msg", "shutdown_msg", "reboot_msg", "authenticating_msg", NULL
+};
+
+Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& themed, PanelType panel_mode)
     : Dpy(dpy), Scr(scr), Root(root), cfg(config), mode(panel_mode), session_name(""), session_exec(""),
+      themedir(themed), resources_loaded(false), message_loaded(false), sessionfont(NULL), image(NULL),
+      panel_image(NULL), background_image(NULL), PanelPixmap(None),
+      LockBackground(None), LockPanel(None),
+      lock_background_width(0), lock_background_height(0),
+      randr_event_base(-1), background(NULL),
+      feedback_until(0), feedback_reopen(false),
+      busy(false), busy_shown(false), busy_at(0), input_dirty(false),
+      keyboard_grabbed(false), grab_handler(NULL), grab_data(NULL),
+      submit_time(0), colormap(None),
       // Load properties from config / theme
       input_name(cfg->getIntOption("input_name_x"), cfg->getIntOption("input_name_y")),
       input_pass(cfg->getIntOption("input_pass_x"), cfg->getIntOption("input_pass_y")),
@@ -36,8 +60,18 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& them
     if (mode == Mode_Lock) {
         Win = root;
         viewport = GetPrimaryViewport();
+    } else {
+        viewport = GetPanelViewport();
     }
 
+    // Follow monitors being added, removed or changing resolution
+    int error_base;
+    if (XRRQueryExtension(Dpy, &randr_event_base, &error_base))
+        XRRSelectInput(Dpy, RootWindow(Dpy, Scr),
+                       RRScreenChangeNotifyMask | RRCrtcChangeNotifyMask);
+    else
+        randr_event_base = -1;
+
     // Init GC
     XGCValues gcv;
     unsigned long gcm = GCForeground | GCBackground | GCGraphicsExposures;
@@ -57,12 +91,73 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& them
         TextGC = XCreateGC(Dpy, Root, gcm, &gcv);
     }
 
-    font = XftFontOpenName(Dpy, Scr, cfg->getOption("input_font").c_str());
-    welcomefont = XftFontOpenName(Dpy, Scr, cfg->getOption("welcome_font").c_str());
-    introfont = XftFontOpenName(Dpy, Scr, cfg->getOption("intro_font").c_str());
-    enterfont = XftFontOpenName(Dpy, Scr, cfg->getOption("username_font").c_str());
-    msgfont = XftFontOpenName(Dpy, Scr, cfg->getOption("msg_font").c_str());
-    text_widget_font = XftFontOpenName(Dpy, Scr, cfg->getOption("text_widget_font").c_str());
+    if (input_pass.x < 0 || input_pass.y < 0) { // single inputbox mode
+        input_pass.x = input_name.x;
+        input_pass.y = input_name.y;
+    }
+
+    text_widget_former_string = "";
+    text_widget_command = cfg->getOption("text_widget_command").c_str();
+    text_widget_interval = std::atof(cfg->getOption("text_widget_interval").c_str());
+
+    // Read (and substitute vars in) the welcome message
+    welcome_message = cfg->getWelcomeMessage();
+    intro_message = cfg->getOption("intro_msg");
+
+    // The greeter loads fonts and images when it is first shown, so an
+    // automatic login never decodes the theme
+    if (mode == Mode_Lock)
+        LoadResources();
+
+    if (mode == Mode_Lock) {
+        input_name.x += X;
+        input_name.y += Y;
+        input_pass.x += X;
+        input_pass.y += Y;
+    }
+
+    if (mode == Mode_Lock) {
+        SetName(getenv("USER"));
+        field = Get_Passwd;
+        OnExpose();
+    }
+}
+
+Panel::~Panel() {
+    FreeResources();
+    FreeMessageResources();
+    XFreeGC(Dpy, TextGC);
+
+    if (mode == Mode_Lock) {
+        XFreeGC(Dpy, WinGC);
+    }
+}
+
+/* Open the fonts, allocate the colors and decode/merge the theme images.
+ * Does nothing if they are already loaded.
+ */
+void Panel::LoadResources() {
+    if (resources_loaded)
+        return;
+
+    font = OpenFont("input_font");
+    welcomefont = OpenFont("welcome_font");
+    introfont = OpenFont("intro_font");
+    enterfont = OpenFont("username_font");
+    LoadMessageResources();
+    text_widget_font = OpenFont("text_widget_font");
+
+    // Rasterise what we are going to draw before the panel shows up, so
+    // the first expose and the first keystrokes don't wait on FreeType
+    string text;
+    for (char c = ' '; c <= '~'; c++)
+        text += c;
+    text += welcome_message;
+    for (int i = 0; MessageOptions[i]; i++)
+        text += cfg->getOption(MessageOptions[i]);
+    for (map<string, XftFont*>::iterator it = fonts.begin(); it != fonts.end(); ++it)
+        PreloadGlyphs(it->second, text);
+    PreloadGlyphs(msgfont, text);
 
     Visual* visual = DefaultVisual(Dpy, Scr);
     Colormap colormap = DefaultColormap(Dpy, Scr);
@@ -73,8 +168,6 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& them
     XftColorAllocName(Dpy, visual, colormap, cfg->getOption("welcome_shadow_color").c_str(), &welcomeshadowcolor);
     XftColorAllocName(Dpy, visual, colormap, cfg->getOption("username_color").c_str(), &entercolor);
     XftColorAllocName(Dpy, visual, colormap, cfg->getOption("username_shadow_color").c_str(), &entershadowcolor);
-    XftColorAllocName(Dpy, visual, colormap, cfg->getOption("msg_color").c_str(), &msgcolor);
-    XftColorAllocName(Dpy, visual, colormap, cfg->getOption("msg_shadow_color").c_str(), &msgshadowcolor);
     XftColorAllocName(Dpy, visual, colormap, cfg->getOption("intro_color").c_str(), &introcolor);
     XftColorAllocName(Dpy, DefaultVisual(Dpy, Scr), colormap,
                       cfg->getOption("session_color").c_str(), &sessioncolor);
@@ -84,23 +177,15 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& them
     XftColorAllocName(Dpy, visual, colormap, cfg->getOption("text_widget_shadow_color").c_str(),
                       &text_widget_shadow_color);
 
-    if (input_pass.x < 0 || input_pass.y < 0) { // single inputbox mode
-        input_pass.x = input_name.x;
-        input_pass.y = input_name.y;
-    }
-
-    text_widget_former_string = "";
-    text_widget_command = cfg->getOption("text_widget_command").c_str();
-    text_widget_interval = std::atof(cfg->getOption("text_widget_interval").c_str());
-
     // Load panel and background image
     string panelpng = "";
     panelpng = panelpng + themedir +"/panel.png";
-    image = new Image;
-    bool loaded = image->Read(panelpng.c_str());
+    panel_image = new Image;
+    panel_image->Dither(cfg->getOption("dither") == "yes");
+    bool loaded = panel_image->Read(panelpng.c_str());
     if (!loaded) { // try jpeg if png failed
         panelpng = themedir + "/panel.jpg";
-        loaded = image->Read(panelpng.c_str());
+        loaded = panel_image->Read(panelpng.c_str());
         if (!loaded) {
             logStream << APPNAME
                  << ": could not load panel image for theme '"
@@ -110,14 +195,15 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& them
         }
     }
 
-    Image* bg = new Image();
+    background_image = new Image();
+    background_image->Dither(cfg->getOption("dither") == "yes");
     string bgstyle = cfg->getOption("background_style");
     if (bgstyle != "color") {
         panelpng = themedir +"/background.png";
-        loaded = bg->Read(panelpng.c_str());
+        loaded = background_image->Read(panelpng.c_str());
         if (!loaded) { // try jpeg if png failed
             panelpng = themedir + "/background.jpg";
-            loaded = bg->Read(panelpng.c_str());
+            loaded = background_image->Read(panelpng.c_str());
             if (!loaded){
                 logStream << APPNAME
                      << ": could not load background image for theme '"
@@ -128,45 +214,25 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& them
         }
     }
 
-    if (mode == Mode_Lock) {
-        if (bgstyle == "stretch") {
-            bg->Resize(viewport.width, viewport.height);
-            //bg->Resize(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
-            //                      XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-        } else if (bgstyle == "tile") {
-            bg->Tile(viewport.width, viewport.height);
-        } else if (bgstyle == "center") {
-            string hexvalue = cfg->getOption("background_color");
-            hexvalue = hexvalue.substr(1,6);
-            bg->Center(viewport.width,
-                       viewport.height,
-                       hexvalue.c_str());
-        } else { // plain color or error
-            string hexvalue = cfg->getOption("background_color");
-            hexvalue = hexvalue.substr(1,6);
-            bg->Center(viewport.width,
-                       viewport.height,
-                       hexvalue.c_str());
-        }
-    } else {
-        if (bgstyle == "stretch") {
-            bg->Resize(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-        } else if (bgstyle == "tile") {
-            bg->Tile(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
-        } else if (bgstyle == "center") {
-            string hexvalue = cfg->getOption("background_color");
-            hexvalue = hexvalue.substr(1,6);
-            bg->Center(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
-                       XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)),
-                       hexvalue.c_str());
-        } else { // plain color or error
-            string hexvalue = cfg->getOption("background_color");
-            hexvalue = hexvalue.substr(1,6);
-            bg->Center(XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
-                       XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)),
-                       hexvalue.c_str());
-        }
-    }
+    Layout();
+
+    resources_loaded = true;
+}
+
+/* Merge the panel with the background of the viewport and position it.
+ * Works from the decoded images only, so it runs again cheaply when
+ * the monitors change.
+ */
+void Panel::Layout() {
+    if (PanelPixmap != None)
+        XFreePixmap(Dpy, PanelPixmap);
+    PanelPixmap = None;
+    delete image;
+    image = new Image(*panel_image);
+
+    string bgstyle = cfg->getOption("background_style");
+    string hexvalue = cfg->getOption("background_color");
+    hexvalue = hexvalue.substr(1,6);
 
     string cfgX = cfg->getOption("input_panel_x");
     string cfgY = cfg->getOption("input_panel_y");
@@ -174,66 +240,275 @@ Panel::Panel(Display* dpy, int scr, Window root, Cfg* config, const string& them
     if (mode == Mode_Lock) {
         X = Cfg::absolutepos(cfgX, viewport.width, image->Width());
         Y = Cfg::absolutepos(cfgY, viewport.height, image->Height());
+        Image::BackgroundStyle style = Image::backgroundStyle(bgstyle.c_str());
+        bool xrender = cfg->getOption("render_backend") == "xrender";
+
+        // The background goes to the server once per monitor size and the
+        // panel once, as its own ARGB pixmap; the frame is put together
+        // from them there.
+        if (LockBackground != None
+            && (lock_background_width != viewport.width
+                || lock_background_height != viewport.height)) {
+            XFreePixmap(Dpy, LockBackground);
+            LockBackground = None;
+        }
+        if (LockBackground == None) {
+            if (xrender)
+                LockBackground = background_image->renderPixmap(Dpy, Scr, Win,
+                        viewport.width, viewport.height, style, hexvalue.c_str());
+            if (LockBackground == None) // no Render, disabled or failed
+                LockBackground = background_image->createPixmap(Dpy, Scr, Win,
+                        viewport.width, viewport.height, style, hexvalue.c_str());
+            lock_background_width = viewport.width;
+            lock_background_height = viewport.height;
+        }
 
-        input_name.x += X;
-        input_name.y += Y;
-        input_pass.x += X;
-        input_pass.y += Y;
-
-        // Merge image into background without crop
-        image->Merge_non_crop(bg, X, Y);
-        PanelPixmap = image->createPixmap(Dpy, Scr, Win);
+        // With Render the two stay apart: the window background is the
+        // background color and ApplyBackground() draws both into the
+        // viewport on expose. Only without it the whole frame is put
+        // together here as the window background.
+        XSetWindowBackground(Dpy, Win,
+                             GetColor(cfg->getOption("background_color").c_str()));
+        if (!xrender)
+            ComposeLockFrame();
     } else {
-        X = Cfg::absolutepos(cfgX, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), image->Width());
-        Y = Cfg::absolutepos(cfgY, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), image->Height());
+        X = Cfg::absolutepos(cfgX, viewport.width, image->Width());
+        Y = Cfg::absolutepos(cfgY, viewport.height, image->Height());
 
-        // Merge image into background
-        image->Merge(bg, X, Y);
+        // Merge image with the part of the monitor's background behind it
+        image->Merge(background_image, X, Y, viewport.width, viewport.height,
+                     Image::backgroundStyle(bgstyle.c_str()),
+                     hexvalue.c_str());
         PanelPixmap = image->createPixmap(Dpy, Scr, Root);
+        X += viewport.x;
+        Y += viewport.y;
     }
-    delete bg;
+}
 
-    // Read (and substitute vars in) the welcome message
-    welcome_message = cfg->getWelcomeMessage();
-    intro_message = cfg->getOption("intro_msg");
+// Set by RenderError() when a request of CompositePanel() failed
+static bool render_failed = false;
+
+static int RenderError(Display* dpy, XErrorEvent* event) {
+    render_failed = true;
+    return 0;
+}
 
+/* Composite the part of the panel inside area (window coordinates) over
+ * the lock window, the panel being uploaded as an ARGB pixmap the first
+ * time. Errors of that first time are caught: on failure the upload is
+ * dropped and false returned, the caller then falls back to
+ * ComposeLockFrame().
+ */
+bool Panel::CompositePanel(Rectangle area) {
+    Rectangle panel(viewport.x + X, viewport.y + Y,
+                    image->Width(), image->Height());
+    area = area.intersected(panel);
+    if (area.is_empty())
+        return true;
+
+    int event_base, error_base;
+    if (!XRenderQueryExtension(Dpy, &event_base, &error_base))
+        return false;
+    XRenderPictFormat* dst_format =
+        XRenderFindVisualFormat(Dpy, DefaultVisual(Dpy, Scr));
+    XRenderPictFormat* src_format =
+        XRenderFindStandardFormat(Dpy, PictStandardARGB32);
+    if (!dst_format || !src_format)
+        return false;
+
+    bool upload = (LockPanel == None);
+    int (*old_handler)(Display*, XErrorEvent*) = NULL;
+    if (upload) {
+        XSync(Dpy, False);
+        render_failed = false;
+        old_handler = XSetErrorHandler(RenderError);
+        LockPanel = image->argbPixmap(Dpy, Win);
+    }
+
+    Picture src = XRenderCreatePicture(Dpy, LockPanel, src_format, 0, NULL);
+    Picture dst = XRenderCreatePicture(Dpy, Win, dst_format, 0, NULL);
+    XRenderComposite(Dpy, PictOpOver, src, None, dst,
+                     area.x - panel.x, area.y - panel.y, 0, 0,
+                     area.x, area.y, area.width, area.height);
+    XRenderFreePicture(Dpy, src);
+    XRenderFreePicture(Dpy, dst);
+    if (!upload)
+        return true;
+
+    XSync(Dpy, False);
+    bool ok = !render_failed;
+    if (!ok) {
+        XFreePixmap(Dpy, LockPanel);
+        LockPanel = None;
+        XSync(Dpy, False);
+    }
+    XSetErrorHandler(old_handler);
+    return ok;
+}
+
+/* Put the whole lock frame together as the window background: the
+ * background and the panel blended with it on the panel's monitor, the
+ * background color elsewhere. The server then repaints from it without
+ * waiting for us, at the cost of a pixmap the size of the screen, so
+ * this is only done without Render.
+ */
+void Panel::ComposeLockFrame() {
+    string bgstyle = cfg->getOption("background_style");
+    string hexvalue = cfg->getOption("background_color");
+    hexvalue = hexvalue.substr(1,6);
+
+    Screen* screen = ScreenOfDisplay(Dpy, Scr);
+    int width = WidthOfScreen(screen);
+    int height = HeightOfScreen(screen);
+    if (PanelPixmap != None)
+        XFreePixmap(Dpy, PanelPixmap);
+    PanelPixmap = XCreatePixmap(Dpy, Win, width, height,
+                                DefaultDepth(Dpy, Scr));
+    if (viewport != Rectangle(0, 0, width, height)) {
+        XSetForeground(Dpy, WinGC,
+                       GetColor(cfg->getOption("background_color").c_str()));
+        XFillRectangle(Dpy, PanelPixmap, WinGC, 0, 0, width, height);
+    }
+    XCopyArea(Dpy, LockBackground, PanelPixmap, WinGC, 0, 0,
+              viewport.width, viewport.height, viewport.x, viewport.y);
+
+    image->Merge(background_image, X, Y, viewport.width, viewport.height,
+                 Image::backgroundStyle(bgstyle.c_str()), hexvalue.c_str());
+    Pixmap panel = image->createPixmap(Dpy, Scr, Win);
+    XCopyArea(Dpy, panel, PanelPixmap, WinGC, 0, 0,
+              image->Width(), image->Height(),
+              viewport.x + X, viewport.y + Y);
+    XFreePixmap(Dpy, panel);
+    XSetWindowBackgroundPixmap(Dpy, Win, PanelPixmap);
+}
+
+/* The monitor layout changed: redraw the root background and move the
+ * panel to the new geometry of its monitor, without reading the theme
+ * again.
+ */
+void Panel::OnScreenChange() {
+    if (background)
+        background->Update();
+
+    Rectangle area;
     if (mode == Mode_Lock) {
-        SetName(getenv("USER"));
-        field = Get_Passwd;
-        OnExpose();
+        XResizeWindow(Dpy, Win, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)),
+                      XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)));
+        area = GetPrimaryViewport();
+    } else {
+        area = GetPanelViewport();
+    }
+    if (area == viewport)
+        return;
+
+    int old_x = X;
+    int old_y = Y;
+    Rectangle old_viewport = viewport;
+    viewport = area;
+    Layout();
+
+    if (mode == Mode_Lock) {
+        // the frame left on the old monitor goes too, not only the new one
+        Rectangle dirty = old_viewport.united(viewport);
+        XClearArea(Dpy, Win, dirty.x, dirty.y, dirty.width, dirty.height, False);
+        input_name.x += X - old_x;
+        input_name.y += Y - old_y;
+        input_pass.x += X - old_x;
+        input_pass.y += Y - old_y;
+    } else {
+        XMoveWindow(Dpy, Win, X, Y);
+        XSetWindowBackgroundPixmap(Dpy, Win, PanelPixmap);
     }
+    OnExpose();
+    XFlush(Dpy);
 }
 
-Panel::~Panel() {
+// The root background is redrawn by the panel when the screen changes
+void Panel::SetBackground(Background* bg) {
+    background = bg;
+}
+
+/* Open the font and allocate the colors of Message(). They outlive
+ * FreeResources(): the reboot/shutdown and error messages drawn while
+ * the panel is down then don't decode the theme images again.
+ */
+void Panel::LoadMessageResources() {
+    if (message_loaded)
+        return;
+
+    msgfont = XftFontOpenName(Dpy, Scr, cfg->getOption("msg_font").c_str());
+    XftColorAllocName(Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr),
+                      cfg->getOption("msg_color").c_str(), &msgcolor);
+    XftColorAllocName(Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr),
+                      cfg->getOption("msg_shadow_color").c_str(), &msgshadowcolor);
+    message_loaded = true;
+}
+
+void Panel::FreeMessageResources() {
+    if (!message_loaded)
+        return;
+
+    XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &msgcolor);
+    XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &msgshadowcolor);
+    if (msgfont)
+        XftFontClose(Dpy, msgfont);
+    msgfont = NULL;
+    message_loaded = false;
+}
+
+/* Drop the fonts, colors, decoded images and the panel pixmap. They are
+ * loaded again by LoadResources() as soon as the panel is drawn again,
+ * so a logged in session does not keep the greeter's heavy state around.
+ * The message font and colors stay, see LoadMessageResources().
+ */
+void Panel::FreeResources() {
+    if (!resources_loaded)
+        return;
+
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &inputcolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &inputshadowcolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &welcomecolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &welcomeshadowcolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &entercolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &entershadowcolor);
-    XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &msgcolor);
-    XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &msgshadowcolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &introcolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &sessioncolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &sessionshadowcolor);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &text_widget_color);
     XftColorFree (Dpy, DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr), &text_widget_shadow_color);
-    XFreeGC(Dpy, TextGC);
-    XftFontClose(Dpy, font);
-    XftFontClose(Dpy, msgfont);
-    XftFontClose(Dpy, introfont);
-    XftFontClose(Dpy, welcomefont);
-    XftFontClose(Dpy, enterfont);
-    XftFontClose(Dpy, text_widget_font);
-
-    if (mode == Mode_Lock) {
-        XFreeGC(Dpy, WinGC);
+    for (map<string, XftFont*>::iterator it = fonts.begin(); it != fonts.end(); ++it) {
+        if (it->second)
+            XftFontClose(Dpy, it->second);
     }
-
+    fonts.clear();
+    sessionfont = NULL;
+
+    if (PanelPixmap != None)
+        XFreePixmap(Dpy, PanelPixmap);
+    PanelPixmap = None;
+    if (LockBackground != None)
+        XFreePixmap(Dpy, LockBackground);
+    LockBackground = None;
+    if (LockPanel != None)
+        XFreePixmap(Dpy, LockPanel);
+    LockPanel = None;
     delete image;
+    image = NULL;
+    delete panel_image;
+    panel_image = NULL;
+    delete background_image;
+    background_image = NULL;
+    XFlush(Dpy);
+
+#ifdef __GLIBC__
+    // hand the freed image buffers back to the system
+    malloc_trim(0);
+#endif
+    resources_loaded = false;
 }
 
 void Panel::OpenPanel() {
+    LoadResources();
     // Create window
     Win = XCreateSimpleWindow(Dpy, Root, X, Y,
                               image->Width(),
@@ -265,6 +540,7 @@ void Panel::ClosePanel() {
 }
 
 void Panel::ClearPanel() {
+    LoadResources();
     session_name = "";
     session_exec = "";
     Reset();
@@ -275,19 +551,35 @@ void Panel::ClearPanel() {
     XFlush(Dpy);
 }
 
+/* Tell the user the password was wrong. Keys are ignored for timeout
+ * seconds, but the event loop keeps running: exposes, monitor changes
+ * and the text widget are still served during the penalty.
+ */
 void Panel::WrongPassword(int timeout) {
-    string message;
-    XGlyphInfo extents;
+    LoadResources();
 
     /*
     if (CapsLockOn)
-        message = cfg->getOption("passwd_feedback_capslock");
+        feedback_message = cfg->getOption("passwd_feedback_capslock");
     else */
-    message = cfg->getOption("passwd_feedback_msg");
+    feedback_message = cfg->getOption("passwd_feedback_msg");
+    feedback_until = CurrentEpochms() + timeout * 1000;
+
+    OnExpose();
+
+    if (cfg->getOption("bell") == "1")
+        XBell(Dpy, 100);
+
+    XFlush(Dpy);
+}
+
+// Draw the wrong password message
+void Panel::ShowFeedback(const string& message) {
+    XGlyphInfo extents;
 
     XftDraw *draw = XftDrawCreate(Dpy, Win,
         DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
-        XftTextExtents8(Dpy, msgfont, reinterpret_cast<const XftChar8*>(message.c_str()),
+    XftTextExtents8(Dpy, msgfont, reinterpret_cast<const XftChar8*>(message.c_str()),
         message.length(), &extents);
 
     string cfgX = cfg->getOption("passwd_feedback_x");
@@ -297,26 +589,40 @@ void Panel::WrongPassword(int timeout) {
     int msg_x = Cfg::absolutepos(cfgX, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.width);
     int msg_y = Cfg::absolutepos(cfgY, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.height);
 
-    OnExpose();
     SlimDrawString8(draw, &msgcolor, msgfont, msg_x, msg_y, message,
         &msgshadowcolor, shadowXOffset, shadowYOffset);
+    XftDrawDestroy(draw);
+}
 
-    if (cfg->getOption("bell") == "1")
-        XBell(Dpy, 100);
+// Tell the user authentication is under way
+void Panel::ShowBusy() {
+    if (mode == Mode_Lock)
+        ShowFeedback(cfg->getOption("authenticating_msg"));
+    else
+        Message(cfg->getOption("authenticating_msg"));
+}
+
+// The penalty after WrongPassword() or Error() is over
+void Panel::EndFeedback() {
+    feedback_until = 0;
+    if (feedback_reopen) {
+        feedback_reopen = false;
+        OpenPanel();
+        ClearPanel();
+        return;
+    }
 
-    XFlush(Dpy);
-    sleep(timeout);
     ResetPasswd();
     OnExpose();
     // The message should stay on the screen even after the password field is
     // cleared, methinks. I don't like this solution, but it works.
-    SlimDrawString8(draw, &msgcolor, msgfont, msg_x, msg_y, message,
-        &msgshadowcolor, shadowXOffset, shadowYOffset);
-    XSync(Dpy, True);
-    XftDrawDestroy(draw);
+    if (!feedback_message.empty())
+        ShowFeedback(feedback_message);
+    XFlush(Dpy);
 }
 
 void Panel::Message(const string& text) {
+    LoadMessageResources();
     string cfgX, cfgY;
     XGlyphInfo extents;
     XftDraw *draw;
@@ -336,8 +642,8 @@ void Panel::Message(const string& text) {
         msg_x = Cfg::absolutepos(cfgX, viewport.width, extents.width);
         msg_y = Cfg::absolutepos(cfgY, viewport.height, extents.height);
     } else {
-        msg_x = Cfg::absolutepos(cfgX, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.width);
-        msg_y = Cfg::absolutepos(cfgY, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.height);
+        msg_x = viewport.x + Cfg::absolutepos(cfgX, viewport.width, extents.width);
+        msg_y = viewport.y + Cfg::absolutepos(cfgY, viewport.height, extents.height);
     }
     SlimDrawString8 (draw, &msgcolor, msgfont, msg_x, msg_y,
                      text,
@@ -347,31 +653,46 @@ void Panel::Message(const string& text) {
     XftDrawDestroy(draw);
 }
 
+/* Show an error with the panel out of the way. The panel comes back
+ * from the event loop once ERROR_DURATION has passed.
+ */
 void Panel::Error(const string& text) {
     ClosePanel();
     Message(text);
-    sleep(ERROR_DURATION);
-    OpenPanel();
-    ClearPanel();
+    feedback_message.clear();
+    feedback_reopen = true;
+    feedback_until = CurrentEpochms() + ERROR_DURATION * 1000;
 }
 
 
+/* The pixel of a color, allocated on first use and kept for the life of
+ * the panel: the theme asks for the same few colors every time it is
+ * drawn, each of them a round trip or two to the server.
+ */
 unsigned long Panel::GetColor(const char* colorname) {
-    XColor color;
-    XWindowAttributes attributes;
+    map<string, unsigned long>::iterator it = colors.find(colorname);
+    if (it != colors.end())
+        return it->second;
 
-    if (mode == Mode_Lock) {
-        XGetWindowAttributes(Dpy, Win, &attributes);
-    } else {
-        XGetWindowAttributes(Dpy, Root, &attributes);
+    if (colormap == None) {
+        XWindowAttributes attributes;
+        if (mode == Mode_Lock) {
+            XGetWindowAttributes(Dpy, Win, &attributes);
+        } else {
+            XGetWindowAttributes(Dpy, Root, &attributes);
+        }
+        colormap = attributes.colormap;
     }
+
+    XColor color;
     color.pixel = 0;
 
-    if(!XParseColor(Dpy, attributes.colormap, colorname, &color))
+    if(!XParseColor(Dpy, colormap, colorname, &color))
         logStream << APPNAME << ": can't parse color " << colorname << endl;
-    else if(!XAllocColor(Dpy, attributes.colormap, &color))
+    else if(!XAllocColor(Dpy, colormap, &color))
         logStream << APPNAME << ": can't allocate color " << colorname << endl;
 
+    colors[colorname] = color.pixel;
     return color.pixel;
 }
 
@@ -428,38 +749,201 @@ void Panel::Cursor(int visible) {
 }
 
 void Panel::EventHandler(const Panel::FieldType& curfield) {
-    XEvent event;
+    LoadResources();
     field=curfield;
-    bool loop = true;
 
-    if (mode == Mode_DM) {
+    if (mode == Mode_DM && !feedback_reopen) {
         OnExpose();
     }
 
-    struct pollfd x11_pfd = {0};
-    x11_pfd.fd = ConnectionNumber(Dpy);
-    x11_pfd.events = POLLIN;
+    RunLoop(-1);
+}
+
+/* Keep the panel alive while authentication runs on another thread:
+ * events are served and keys ignored until fd becomes readable. The
+ * authenticating message only shows up if this takes a while.
+ */
+void Panel::Busy(int fd) {
+    LoadResources();
+    busy = true;
+    busy_at = CurrentEpochms() + BUSY_MSG_DELAY;
+
+    RunLoop(fd);
+
+    busy = false;
+    if (busy_shown) {
+        busy_shown = false;
+        if (mode == Mode_Lock)
+            OnExpose();
+        else
+            XClearWindow(Dpy, Root);
+        XFlush(Dpy);
+    }
+}
+
+/* Lock mode: take the keyboard unless we have it already. Fails while
+ * another client holds it (an open menu, a screenshot tool); the event
+ * loop keeps trying. Returns whether the keyboard is ours.
+ */
+bool Panel::GrabKeyboard() {
+    if (keyboard_grabbed)
+        return true;
+    if (XGrabKeyboard(Dpy, RootWindow(Dpy, Scr), True, GrabModeAsync,
+                      GrabModeAsync, CurrentTime) != GrabSuccess)
+        return false;
+
+    keyboard_grabbed = true;
+    if (grab_handler) {
+        void (*handler)(void*) = grab_handler;
+        grab_handler = NULL;
+        handler(grab_data);
+    }
+    return true;
+}
+
+void Panel::UngrabKeyboard() {
+    XUngrabKeyboard(Dpy, CurrentTime);
+    keyboard_grabbed = false;
+    grab_handler = NULL;
+}
+
+// Run handler(data) once, as soon as GrabKeyboard() succeeds
+void Panel::SetGrabHandler(void (*handler)(void*), void* data) {
+    grab_handler = handler;
+    grab_data = data;
+}
+
+// The event loop: runs until a key ends the input, or until fd is readable
+void Panel::RunLoop(int fd) {
+    XEvent event;
+    bool loop = true;
+
+    bool screen_changed = false;
+    struct pollfd pfd[2];
+    pfd[0].fd = ConnectionNumber(Dpy);
+    pfd[0].events = POLLIN;
+    pfd[1].fd = fd; // ignored by poll() when negative
+    pfd[1].events = POLLIN;
     uint64_t last_time = CurrentEpochms();
     while(loop) {
         if (mode == Mode_Lock)
             UpdateTextWidget(&last_time);
-        if(XPending(Dpy) || poll(&x11_pfd, 1, 100) > 0) {
-            while(XPending(Dpy)) {
+        int timeout = 100;
+        uint64_t now = CurrentEpochms();
+        if (feedback_until) {
+            if (now >= feedback_until)
+                EndFeedback();
+            else if (feedback_until - now < 100)
+                timeout = feedback_until - now;
+        }
+        // someone else holds the keyboard: try again on every tick
+        if (mode == Mode_Lock && !GrabKeyboard() && timeout > GRAB_RETRY)
+            timeout = GRAB_RETRY;
+        if (busy && !busy_shown) {
+            if (now >= busy_at) {
+                busy_shown = true;
+                ShowBusy();
+                XFlush(Dpy);
+            } else if (busy_at - now < (uint64_t) timeout) {
+                timeout = busy_at - now;
+            }
+        }
+        pfd[0].revents = pfd[1].revents = 0;
+        if(XPending(Dpy) || poll(pfd, 2, timeout) > 0) {
+            // Drain everything queued before drawing: a burst of keys
+            // is applied as a whole and drawn once below. A key ending
+            // the input leaves whatever follows it for the next field.
+            while(loop && XPending(Dpy)) {
                 XNextEvent(Dpy, &event);
                 switch(event.type) {
                     case Expose:
-                        OnExpose();
+                        if (!feedback_reopen)
+                            OnExpose();
                         break;
 
                     case KeyPress:
-                        loop=OnKeyPress(event);
+                        // input is locked while feedback is shown or
+                        // authentication is running
+                        if (!feedback_until && !busy)
+                            loop=OnKeyPress(event);
+                        break;
+
+                    // Lock mode: stay on top of everything and keep the
+                    // keyboard, reacting as soon as someone interferes
+                    case VisibilityNotify:
+                        if (mode == Mode_Lock
+                            && event.xvisibility.state != VisibilityUnobscured)
+                            XRaiseWindow(Dpy, Win);
+                        break;
+
+                    case MapNotify:
+                        if (mode == Mode_Lock && event.xmap.window != Win)
+                            XRaiseWindow(Dpy, Win);
+                        break;
+
+                    case ConfigureNotify:
+                        if (mode == Mode_Lock && event.xconfigure.window != Win)
+                            XRaiseWindow(Dpy, Win);
+                        break;
+
+                    // our grab ended, or another client's grab did
+                    case FocusOut:
+                        if (mode == Mode_Lock && event.xfocus.mode == NotifyUngrab) {
+                            keyboard_grabbed = false;
+                            GrabKeyboard();
+                        }
+                        break;
+
+                    case FocusIn:
+                        if (mode == Mode_Lock && event.xfocus.mode == NotifyUngrab)
+                            GrabKeyboard();
+                        break;
+
+                    default:
+                        if (IsScreenChange(event))
+                            screen_changed = true;
                         break;
                 }
             }
+            if (input_dirty)
+                RedrawInput();
+            // a single re-layout for a whole burst of RandR events
+            if (screen_changed) {
+                screen_changed = false;
+                OnScreenChange();
+            }
         }
+        if (pfd[1].revents & POLLIN)
+            loop = false;
+    }
+}
+
+/* Handle the events queued while the lock window is hidden, so a
+ * resident slimlock keeps its frame in step with the monitors.
+ */
+void Panel::ProcessEvents() {
+    XEvent event;
+    bool screen_changed = false;
+
+    while (XPending(Dpy)) {
+        XNextEvent(Dpy, &event);
+        if (IsScreenChange(event))
+            screen_changed = true;
     }
+    if (screen_changed)
+        OnScreenChange();
+}
 
-    return;
+// Let Xlib update the screen size from a RandR event and tell if it was one
+bool Panel::IsScreenChange(XEvent& event) {
+    if (randr_event_base < 0)
+        return false;
+    if (event.type != randr_event_base + RRScreenChangeNotify
+        && event.type != randr_event_base + RRNotify)
+        return false;
+
+    XRRUpdateConfiguration(&event);
+    return true;
 }
 
 void Panel::OnExpose(void) {
@@ -503,16 +987,16 @@ void Panel::OnExpose(void) {
     XftDrawDestroy (draw);
     Cursor(SHOW);
     ShowText();
+    if (busy_shown)
+        ShowBusy();
+    else if (feedback_until && !feedback_message.empty())
+        ShowFeedback(feedback_message);
 }
 
 bool Panel::OnKeyPress(XEvent& event) {
     char ascii;
     KeySym keysym;
     XComposeStatus compstatus;
-    int xx = 0;
-    int yy = 0;
-    string text;
-    string formerString = "";
 
     XLookupString(&event.xkey, &ascii, 1, &keysym, &compstatus);
     switch(keysym){
@@ -522,11 +1006,13 @@ bool Panel::OnKeyPress(XEvent& event) {
 
         case XK_F11:
             // Take a screenshot
-            system(cfg->getOption("screenshot_cmd").c_str());
+            Launcher::Run(cfg->getOption("screenshot_cmd"));
             return true;
 
         case XK_Return:
         case XK_KP_Enter:
+            if (field==Get_Passwd)
+                submit_time = CurrentEpochms();
             if (field==Get_Name){
                 // Don't allow an empty username
                 if (NameBuffer.empty()) return true;
@@ -554,20 +1040,24 @@ bool Panel::OnKeyPress(XEvent& event) {
             break;
     };
 
-    Cursor(HIDE);
+    // The first key of a batch hides the cursor and remembers what the
+    // field showed; RedrawInput() updates the field once for the batch
+    if (!input_dirty) {
+        Cursor(HIDE);
+        input_former = (field == Get_Name) ? NameBuffer : HiddenPasswdBuffer;
+        input_dirty = true;
+    }
     switch(keysym){
         case XK_Delete:
         case XK_BackSpace:
             switch(field) {
                 case GET_NAME:
                     if (! NameBuffer.empty()){
-                        formerString=NameBuffer;
                         NameBuffer.erase(--NameBuffer.end());
                     };
                     break;
                 case GET_PASSWD:
                     if (! PasswdBuffer.empty()){
-                        formerString=HiddenPasswdBuffer;
                         PasswdBuffer.erase(--PasswdBuffer.end());
                         HiddenPasswdBuffer.erase(--HiddenPasswdBuffer.end());
                     };
@@ -580,13 +1070,11 @@ bool Panel::OnKeyPress(XEvent& event) {
             if (reinterpret_cast<XKeyEvent&>(event).state & ControlMask) {
                 switch(field) {
                     case Get_Passwd:
-                        formerString = HiddenPasswdBuffer;
                         HiddenPasswdBuffer.clear();
                         PasswdBuffer.clear();
                         break;
 
                     case Get_Name:
-                        formerString = NameBuffer;
                         NameBuffer.clear();
                         break;
                 }
@@ -599,13 +1087,11 @@ bool Panel::OnKeyPress(XEvent& event) {
                 switch(field) {
                     case GET_NAME:
                         if (! NameBuffer.empty()){
-                            formerString=NameBuffer;
                             NameBuffer.erase(--NameBuffer.end());
                         };
                         break;
                     case GET_PASSWD:
                         if (! PasswdBuffer.empty()){
-                            formerString=HiddenPasswdBuffer;
                             PasswdBuffer.erase(--PasswdBuffer.end());
                             HiddenPasswdBuffer.erase(--HiddenPasswdBuffer.end());
                         };
@@ -619,13 +1105,11 @@ bool Panel::OnKeyPress(XEvent& event) {
             if (isprint(ascii) && (keysym < XK_Shift_L || keysym > XK_Hyper_R)){
                 switch(field) {
                     case GET_NAME:
-                        formerString=NameBuffer;
                         if (NameBuffer.length() < INPUT_MAXLENGTH_NAME-1){
                             NameBuffer.append(&ascii,1);
                         };
                         break;
                     case GET_PASSWD:
-                        formerString=HiddenPasswdBuffer;
                         if (PasswdBuffer.length() < INPUT_MAXLENGTH_PASSWD-1){
                             PasswdBuffer.append(&ascii,1);
                             HiddenPasswdBuffer.append("*");
@@ -636,6 +1120,19 @@ bool Panel::OnKeyPress(XEvent& event) {
             break;
     };
 
+    return true;
+}
+
+/* Show the input field after a batch of key presses: clear the text it
+ * showed before the batch, draw the current one and the cursor.
+ */
+void Panel::RedrawInput() {
+    int xx = 0;
+    int yy = 0;
+    string text;
+
+    input_dirty = false;
+
     XGlyphInfo extents;
     XftDraw *draw = XftDrawCreate(Dpy, Win,
                                   DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
@@ -654,13 +1151,13 @@ bool Panel::OnKeyPress(XEvent& event) {
             break;
     }
 
-    if (!formerString.empty()){
+    if (!input_former.empty() && input_former != text){
         const char* txth = "Wj"; // get proper maximum height ?
         XftTextExtents8(Dpy, font, reinterpret_cast<const XftChar8*>(txth), strlen(txth), &extents);
         int maxHeight = extents.height;
 
-        XftTextExtents8(Dpy, font, reinterpret_cast<const XftChar8*>(formerString.c_str()),
-                        formerString.length(), &extents);
+        XftTextExtents8(Dpy, font, reinterpret_cast<const XftChar8*>(input_former.c_str()),
+                        input_former.length(), &extents);
         int maxLength = extents.width;
 
         if (mode == Mode_Lock) {
@@ -682,7 +1179,6 @@ bool Panel::OnKeyPress(XEvent& event) {
 
     XftDrawDestroy (draw);
     Cursor(SHOW);
-    return true;
 }
 
 // Draw welcome and "enter username" message
@@ -694,6 +1190,10 @@ void Panel::ShowText(){
     input_name.x == input_pass.x &&
     input_name.y == input_pass.y;
 
+    // The lock screen places the texts on the monitor, the greeter on the panel
+    int area_width = (mode == Mode_Lock) ? (int) viewport.width : image->Width();
+    int area_height = (mode == Mode_Lock) ? (int) viewport.height : image->Height();
+
     XftDraw *draw = XftDrawCreate(Dpy, Win,
                                   DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
     /* welcome message */
@@ -704,8 +1204,8 @@ void Panel::ShowText(){
     int shadowXOffset = cfg->getIntOption("welcome_shadow_xoffset");
     int shadowYOffset = cfg->getIntOption("welcome_shadow_yoffset");
 
-    welcome.x = Cfg::absolutepos(cfgX, image->Width(), extents.width);
-    welcome.y = Cfg::absolutepos(cfgY, image->Height(), extents.height);
+    welcome.x = Cfg::absolutepos(cfgX, area_width, extents.width);
+    welcome.y = Cfg::absolutepos(cfgY, area_height, extents.height);
     if (welcome.x >= 0 && welcome.y >= 0) {
         SlimDrawString8 (draw, &welcomecolor, welcomefont,
                          welcome.x, welcome.y,
@@ -723,8 +1223,8 @@ void Panel::ShowText(){
         cfgY = cfg->getOption("password_y");
         int shadowXOffset = cfg->getIntOption("username_shadow_xoffset");
         int shadowYOffset = cfg->getIntOption("username_shadow_yoffset");
-        password.x = Cfg::absolutepos(cfgX, image->Width(), extents.width);
-        password.y = Cfg::absolutepos(cfgY, image->Height(), extents.height);
+        password.x = Cfg::absolutepos(cfgX, area_width, extents.width);
+        password.y = Cfg::absolutepos(cfgY, area_height, extents.height);
         if (password.x >= 0 && password.y >= 0){
             SlimDrawString8 (draw, &entercolor, enterfont, password.x, password.y,
                              msg, &entershadowcolor, shadowXOffset, shadowYOffset);
@@ -738,8 +1238,8 @@ void Panel::ShowText(){
         cfgY = cfg->getOption("username_y");
         int shadowXOffset = cfg->getIntOption("username_shadow_xoffset");
         int shadowYOffset = cfg->getIntOption("username_shadow_yoffset");
-        username.x = Cfg::absolutepos(cfgX, image->Width(), extents.width);
-        username.y = Cfg::absolutepos(cfgY, image->Height(), extents.height);
+        username.x = Cfg::absolutepos(cfgX, area_width, extents.width);
+        username.y = Cfg::absolutepos(cfgY, area_height, extents.height);
         if (username.x >= 0 && username.y >= 0){
             SlimDrawString8 (draw, &entercolor, enterfont, username.x, username.y,
                              msg, &entershadowcolor, shadowXOffset, shadowYOffset);
@@ -778,7 +1278,8 @@ void Panel::ShowSession() {
     string currsession = cfg->getOption("session_msg") + " " + session_name;
     XGlyphInfo extents;
 
-	sessionfont = XftFontOpenName(Dpy, Scr, cfg->getOption("session_font").c_str());
+	if (!sessionfont)
+		sessionfont = OpenFont("session_font");
 
 	XftDraw *draw = XftDrawCreate(Dpy, Root,
                                   DefaultVisual(Dpy, Scr), DefaultColormap(Dpy, Scr));
@@ -788,6 +1289,10 @@ void Panel::ShowSession() {
     msg_y = cfg->getOption("session_y");
     int x = Cfg::absolutepos(msg_x, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.width);
     int y = Cfg::absolutepos(msg_y, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.height);
+    if (mode == Mode_DM) {
+        x = viewport.x + Cfg::absolutepos(msg_x, viewport.width, extents.width);
+        y = viewport.y + Cfg::absolutepos(msg_y, viewport.height, extents.height);
+    }
     int shadowXOffset = cfg->getIntOption("session_shadow_xoffset");
     int shadowYOffset = cfg->getIntOption("session_shadow_yoffset");
 
@@ -800,6 +1305,78 @@ void Panel::ShowSession() {
 }
 
 
+/* Open the font named by a config option. Options naming the same font
+ * share one XftFont, so each distinct font is matched and opened once.
+ */
+XftFont* Panel::OpenFont(const char* option) {
+    const string& name = cfg->getOption(option);
+    map<string, XftFont*>::iterator it = fonts.find(name);
+    if (it != fonts.end())
+        return it->second;
+
+    XftFont* f = XftFontOpenName(Dpy, Scr, name.c_str());
+    fonts[name] = f;
+    return f;
+}
+
+// Load the glyphs of a UTF-8 string into the font's glyph cache
+void Panel::PreloadGlyphs(XftFont* font, const string& text) {
+    if (!font)
+        return;
+
+    vector<FT_UInt> glyphs;
+    const FcChar8* p = reinterpret_cast<const FcChar8*>(text.c_str());
+    int len = text.length();
+    while (len > 0) {
+        FcChar32 ucs4;
+        int n = FcUtf8ToUcs4(p, &ucs4, len);
+        if (n <= 0)
+            break;
+        FT_UInt glyph = XftCharIndex(Dpy, font, ucs4);
+        if (glyph)
+            glyphs.push_back(glyph);
+        p += n;
+        len -= n;
+    }
+    if (!glyphs.empty())
+        XftFontLoadGlyphs(Dpy, font, FcTrue, &glyphs[0], glyphs.size());
+}
+
+// The distinct font names the theme uses
+vector<string> Panel::FontNames(Cfg* config) {
+    vector<string> names;
+    for (int i = 0; FontOptions[i]; i++) {
+        const string& name = config->getOption(FontOptions[i]);
+        if (find(names.begin(), names.end(), name) == names.end())
+            names.push_back(name);
+    }
+    return names;
+}
+
+/* Run the fontconfig matching for the theme fonts. This needs no display,
+ * so it can run while the X server starts up; it loads the fontconfig
+ * configuration and caches, and makes the later XftFontOpenName() calls
+ * cheap.
+ */
+void Panel::MatchFonts(const vector<string>& names) {
+    if (!FcInit())
+        return;
+
+    for (vector<string>::const_iterator it = names.begin(); it != names.end(); ++it) {
+        FcPattern* pattern = FcNameParse(reinterpret_cast<const FcChar8*>(it->c_str()));
+        if (!pattern)
+            continue;
+        FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+        FcDefaultSubstitute(pattern);
+
+        FcResult result;
+        FcPattern* match = FcFontMatch(NULL, pattern, &result);
+        if (match)
+            FcPatternDestroy(match);
+        FcPatternDestroy(pattern);
+    }
+}
+
 void Panel::SlimDrawString8(XftDraw *d, XftColor *color, XftFont *font,
                             int x, int y, const string& str,
                             XftColor* shadowColor,
@@ -826,6 +1403,11 @@ Panel::ActionType Panel::getAction(void) const{
     return action;
 };
 
+// When the password was submitted, 0 if it never was
+uint64_t Panel::GetSubmitTime(void) const {
+    return submit_time;
+}
+
 void Panel::Reset(void){
     ResetName();
     ResetPasswd();
@@ -858,109 +1440,72 @@ const string& Panel::GetPasswd(void) const{
 };
 
 Rectangle Panel::GetPrimaryViewport() {
-    Rectangle fallback;
-    Rectangle result;
-
-    RROutput primary;
-    XRROutputInfo *primary_info;
-    XRRScreenResources *resources;
-    XRRCrtcInfo *crtc_info;
-
-    int crtc;
-
-    fallback.x = 0;
-    fallback.y = 0;
-    fallback.width = DisplayWidth(Dpy, Scr);
-    fallback.height = DisplayHeight(Dpy, Scr);
-
-    primary = XRRGetOutputPrimary(Dpy, Win);
-    if (!primary) {
-        return fallback;
-    }
-    resources = XRRGetScreenResources(Dpy, Win);
-    if (!resources)
-        return fallback;
-
-    primary_info = XRRGetOutputInfo(Dpy, resources, primary);
-        if (!primary_info) {
-            XRRFreeScreenResources(resources);
-            return fallback;
-        }
-
-    // Fixes bug with multiple monitors.  Just pick first monitor if
-    // XRRGetOutputInfo gives returns bad into for crtc.
-    if (primary_info->crtc < 1) {
-        if (primary_info->ncrtc > 0) {
-            crtc = primary_info->crtcs[0];
-        } else {
-            cerr << "Cannot get crtc from xrandr.\n";
-            exit(EXIT_FAILURE);
-        }
-    } else {
-        crtc = primary_info->crtc;
-    }
-
-    crtc_info = XRRGetCrtcInfo(Dpy, resources, crtc);
-
-    if (!crtc_info) {
-        XRRFreeOutputInfo(primary_info);
-        XRRFreeScreenResources(resources);
-        return fallback;
-    }
+    int primary;
+    vector<Rectangle> monitors = Monitor::List(Dpy, Scr,
+                                               RootWindow(Dpy, Scr), &primary);
 
-    result.x = crtc_info->x;
-    result.y = crtc_info->y;
-    result.width = crtc_info->width;
-    result.height = crtc_info->height;
+    return monitors[primary >= 0 ? primary : 0];
+};
 
-    XRRFreeCrtcInfo(crtc_info);
-    XRRFreeOutputInfo(primary_info);
-    XRRFreeScreenResources(resources);
+// The monitor showing the login panel: the primary or the pointer's one
+Rectangle Panel::GetPanelViewport() {
+    int primary;
+    vector<Rectangle> monitors = Monitor::List(Dpy, Scr, Root, &primary);
 
-    return result;
+    return monitors[Monitor::Preferred(Dpy, Root, monitors, primary)];
 };
 
+/* Repaint rect of the lock window, in viewport coordinates (by default
+ * the whole viewport). With Render the background and the panel are
+ * drawn from their own pixmaps, outside the viewport the window
+ * background is the background color; without, it is the whole frame.
+ */
 void Panel::ApplyBackground(Rectangle rect) {
-    int ret = 0;
-
     if (rect.is_empty()) {
         rect.x = 0;
         rect.y = 0;
         rect.width = viewport.width;
         rect.height = viewport.height;
     }
-
-    ret = XCopyArea(Dpy, PanelPixmap, Win, WinGC,
-            rect.x, rect.y, rect.width, rect.height,
-            viewport.x + rect.x, viewport.y + rect.y);
-
-    if (!ret) {
-        cerr << APPNAME << ": failed to put pixmap on the screen\n.";
+    rect.x += viewport.x;
+    rect.y += viewport.y;
+
+    if (PanelPixmap == None) {
+        Rectangle area = rect.intersected(viewport);
+        if (area != rect)
+            XClearArea(Dpy, Win, rect.x, rect.y,
+                       rect.width, rect.height, False);
+        if (area.is_empty())
+            return;
+        XCopyArea(Dpy, LockBackground, Win, WinGC,
+                  area.x - viewport.x, area.y - viewport.y,
+                  area.width, area.height, area.x, area.y);
+        if (CompositePanel(area))
+            return;
+        ComposeLockFrame(); // Render failed: the server repaints below
     }
+
+    XClearArea(Dpy, Win, rect.x, rect.y, rect.width, rect.height, False);
 };
 
+// Run the widget command, giving up on it once its refresh interval has passed
 std::string Panel::Execute(const char* cmd) {
-    std::array<char, 128> buffer;
-    std::string result;
-    std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(cmd, "r"), pclose);
-    if (!pipe) {
-        throw std::runtime_error("popen() failed!");
-    }
-    while (fgets(buffer.data(), buffer.size(), pipe.get()) != nullptr) {
-        result += buffer.data();
-    }
-    return result;
+    double msec = text_widget_interval * 1000.0;
+    int timeout;
+    if (!(msec > 0))
+        timeout = 0;    // no interval (or garbage): no limit either
+    else if (msec >= INT_MAX)
+        timeout = INT_MAX;
+    else
+        timeout = std::max(1, (int) msec);
+    return Launcher::Capture(cmd, timeout);
 }
 
+// Position of the text widget on the monitor, in window (lock) or root coordinates
 void Panel::CalcPos(std::string cfgX, std::string cfgY, XGlyphInfo extents, Rectangle *rect)
 {
-    if (mode == Mode_Lock) {
-        rect->x = Cfg::absolutepos(cfgX, viewport.width, extents.width);
-        rect->y = Cfg::absolutepos(cfgY, viewport.height, extents.height);
-    } else {
-        rect->x = Cfg::absolutepos(cfgX, XWidthOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.width);
-        rect->y = Cfg::absolutepos(cfgY, XHeightOfScreen(ScreenOfDisplay(Dpy, Scr)), extents.height);
-    }
+    rect->x = viewport.x + Cfg::absolutepos(cfgX, viewport.width, extents.width);
+    rect->y = viewport.y + Cfg::absolutepos(cfgY, viewport.height, extents.height);
 }
 
 uint64_t Panel::CurrentEpochms()
@@ -990,9 +1535,17 @@ void Panel::UpdateTextWidget(uint64_t *last_time)
         rect.width = extents.width + text_widget_shadow_offset.x;
         rect.height = extents.height + text_widget_shadow_offset.y;
 
-        int ret = XCopyArea(Dpy, PanelPixmap, target, WinGC,
-                            rect.x, rect.y, rect.width, rect.height,
-                            rect.x, rect.y);
+        // Put back what was under the former text: the lock frame, or
+        // the root background the greeter draws over
+        if (rect.is_empty()) {
+            // nothing drawn yet
+        } else if (mode == Mode_Lock) {
+            ApplyBackground(Rectangle(rect.x - viewport.x, rect.y - viewport.y,
+                                      rect.width, rect.height));
+        } else {
+            XClearArea(Dpy, target, rect.x, rect.y,
+                       rect.width, rect.height, False);
+        }
 
         std::string cmd_result = Execute(text_widget_command);
 
@@ -23,6 +23,8 @@
 #include <signal.h>
 #include <iostream>
 #include <string>
+#include <map>
+#include <vector>
 
 #ifdef NEEDS_BASENAME
 #include <libgen.h>
@@ -32,19 +34,8 @@
 #include "log.h"
 #include "image.h"
 #include "coord.h"
-struct Rectangle {
-    int x;
-    int y;
-    unsigned int width;
-    unsigned int height;
-
-    Rectangle() : x(0), y(0), width(0), height(0) {};
-    Rectangle(int x, int y, unsigned int width, unsigned int height) :
-              x(x), y(y), width(width), height(height) {};
-    bool is_empty() const {
-            return width == 0 || height == 0;
-    }
-};
+#include "monitor.h"
+#include "background.h"
 
 class Panel {
 public:
@@ -69,6 +60,9 @@ public:
     Panel(Display* dpy, int scr, Window root, Cfg* config,
           const std::string& themed, PanelType panel_mode);
     ~Panel();
+    void LoadResources();
+    void FreeResources();
+    void SetBackground(Background* bg);
     void OpenPanel();
     void ClosePanel();
     void ClearPanel();
@@ -76,6 +70,11 @@ public:
     void Message(const std::string& text);
     void Error(const std::string& text);
     void EventHandler(const FieldType& curfield);
+    void Busy(int fd);
+    void ProcessEvents();
+    bool GrabKeyboard();
+    void UngrabKeyboard();
+    void SetGrabHandler(void (*handler)(void*), void* data);
     std::string getSession();
     ActionType getAction(void) const;
 
@@ -85,15 +84,30 @@ public:
     void SetName(const std::string& name);
     const std::string& GetName(void) const;
     const std::string& GetPasswd(void) const;
+    uint64_t GetSubmitTime(void) const;
+    static uint64_t CurrentEpochms();
+
+    // Font names of the theme, and fontconfig matching ahead of time
+    static std::vector<std::string> FontNames(Cfg* config);
+    static void MatchFonts(const std::vector<std::string>& names);
 private:
     Panel();
     void Cursor(int visible);
     unsigned long GetColor(const char* colorname);
     void OnExpose(void);
     bool OnKeyPress(XEvent& event);
+    void RedrawInput();
     void ShowText();
     void SwitchSession();
     void ShowSession();
+    void ShowFeedback(const std::string& message);
+    void EndFeedback();
+    void ShowBusy();
+    void RunLoop(int fd);
+    XftFont* OpenFont(const char* option);
+    void LoadMessageResources();
+    void FreeMessageResources();
+    void PreloadGlyphs(XftFont* font, const std::string& text);
 
     void SlimDrawString8(XftDraw *d, XftColor *color, XftFont *font,
                             int x, int y, const std::string& str,
@@ -101,12 +115,17 @@ private:
                             int xOffset, int yOffset);
 
     Rectangle GetPrimaryViewport();
+    Rectangle GetPanelViewport();
+    void Layout();
+    void OnScreenChange();
+    bool IsScreenChange(XEvent& event);
     void ApplyBackground(Rectangle = Rectangle());
+    bool CompositePanel(Rectangle area);
+    void ComposeLockFrame();
 
     void CalcPos(std::string cfgX, std::string cfgY, XGlyphInfo extents, Rectangle *rect);
     void UpdateTextWidget(uint64_t *last_time);
     std::string Execute(const char *cmd);
-    uint64_t CurrentEpochms();
 
     // Private data
     PanelType mode; // work mode
@@ -141,14 +160,43 @@ private:
     XftColor text_widget_color;
     XftColor text_widget_shadow_color;
     XftFont *text_widget_font;
+    std::map<std::string, XftFont*> fonts; // open fonts by name, shared between options
+    Colormap colormap; // of the panel's window, None until needed
+    std::map<std::string, unsigned long> colors; // allocated pixels by color name
 
     // Username/Password
     std::string NameBuffer;
     std::string PasswdBuffer;
     std::string HiddenPasswdBuffer;
+    uint64_t submit_time;   // when Enter was pressed on the password
 
-    // screen stuff
+    // screen stuff: the monitor the panel is shown on
     Rectangle viewport;
+    int randr_event_base;   // -1 without RandR
+    Background* background; // root background to update on screen changes
+
+    // Feedback after a wrong password or an error: keys are ignored
+    // until feedback_until (CurrentEpochms() time, 0 when not shown)
+    uint64_t feedback_until;
+    std::string feedback_message;
+    bool feedback_reopen;   // Error() closed the panel, reopen it
+
+    // Authentication running on the AuthWorker thread: keys are ignored
+    // and the message shows up at busy_at
+    bool busy;
+    bool busy_shown;
+    uint64_t busy_at;
+
+    // Keys applied to the buffers but not drawn yet, and what the input
+    // field showed before them
+    bool input_dirty;
+    std::string input_former;
+
+    // Lock mode: the keyboard is ours; until then the grab is retried
+    // and the handler runs once it succeeds
+    bool keyboard_grabbed;
+    void (*grab_handler)(void*);
+    void* grab_data;
 
     // Configuration
     Coord input_name;
@@ -169,15 +217,28 @@ private:
     std::string text_widget_former_string;
     float text_widget_interval;
 
-    // Pixmap data
+    // Pixmap data; in lock mode the whole frame, only made without Render
     Pixmap PanelPixmap;
+    // Lock mode: the background laid out on the monitor and the panel
+    // (ARGB, None without Render), composited into the viewport by the server
+    Pixmap LockBackground;
+    Pixmap LockPanel;
+    unsigned int lock_background_width;
+    unsigned int lock_background_height;
 
-    Image* image;
+    Image* image;               // panel merged with its background
+    Image* panel_image;         // decoded theme images
+    Image* background_image;
 
     // For thesting themes
     bool testing;
     std::string themedir;
 
+    // Fonts, colors and images are loaded
+    bool resources_loaded;
+    // The message font and colors, kept by FreeResources()
+    bool message_loaded;
+
     // Session handling
     std::string session_name;
     std::string session_exec;
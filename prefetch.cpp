@@ -0,0 +1,238 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "const.h"
+#include "prefetch.h"
+
+using namespace std;
+
+/* One lookup. It belongs to both the UserPrefetch and the thread, the
+ * last one to let go of it frees it, so either can walk away.
+ */
+struct UserPrefetch::Job {
+    // set before the thread starts, read-only afterwards
+    string name;
+    string session_cmd;
+    string search_path;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int refs;
+    bool looked_up;     // pw and found are valid
+
+    bool found;
+    struct passwd pw;
+    vector<char> buffer;    // strings of pw
+};
+
+// Lookup threads inside getpwnam_r(), stuck ones included
+static pthread_mutex_t nss_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int nss_lookups = 0;
+
+UserPrefetch::UserPrefetch()
+    : job(NULL)
+{
+}
+
+UserPrefetch::~UserPrefetch() {
+    Release(job);
+}
+
+/* Start looking user up in the background. A lookup for another name
+ * still running is left to finish on its own; asking again for the
+ * same name keeps what we have.
+ */
+void UserPrefetch::Start(const string& user, const string& session,
+                         const string& path) {
+    if (job && user == job->name) {
+        pthread_mutex_lock(&job->mutex);
+        bool missing = job->looked_up && !job->found;
+        pthread_mutex_unlock(&job->mutex);
+        if (!missing)
+            return;
+    }
+    Discard();
+
+    // The thread gets its own copies, Cfg and the panel aren't thread-safe
+    Job* next = new Job;
+    next->name = user;
+    next->session_cmd = session;
+    next->search_path = path;
+    pthread_mutex_init(&next->mutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&next->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    next->refs = 2;
+    next->looked_up = false;
+    next->found = false;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, Thread, next) != 0) {
+        next->refs = 1;
+        Release(next);
+        return;
+    }
+    pthread_detach(thread);
+    job = next;
+}
+
+/* The passwd entry of user, waiting up to PREFETCH_TIMEOUT for the
+ * lookup if it is still running. NULL if nothing was prefetched for
+ * user or the lookup is stuck, the caller then does it itself.
+ */
+struct passwd* UserPrefetch::Get(const string& user) {
+    if (!job || user != job->name)
+        return NULL;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += PREFETCH_TIMEOUT / 1000;
+    deadline.tv_nsec += (PREFETCH_TIMEOUT % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&job->mutex);
+    while (!job->looked_up
+           && pthread_cond_timedwait(&job->cond, &job->mutex,
+                                     &deadline) != ETIMEDOUT)
+        ;
+    bool looked_up = job->looked_up;
+    bool found = job->found;
+    pthread_mutex_unlock(&job->mutex);
+
+    if (!looked_up) {
+        Discard();
+        return NULL;
+    }
+    return found ? &job->pw : NULL;
+}
+
+// Forget the lookup, after a failed login
+void UserPrefetch::Discard() {
+    Release(job);
+    job = NULL;
+}
+
+/* A child forked while a lookup thread is inside NSS inherits the locks
+ * that thread holds, and hangs as soon as it looks anything up itself.
+ * Only the caller's thread starts lookups, so this stays true until the
+ * next Start().
+ */
+bool UserPrefetch::Idle() {
+    pthread_mutex_lock(&nss_mutex);
+    bool idle = (nss_lookups == 0);
+    pthread_mutex_unlock(&nss_mutex);
+    return idle;
+}
+
+void UserPrefetch::Release(Job* lookup) {
+    if (!lookup)
+        return;
+    pthread_mutex_lock(&lookup->mutex);
+    bool last = (--lookup->refs == 0);
+    pthread_mutex_unlock(&lookup->mutex);
+    if (last) {
+        pthread_cond_destroy(&lookup->cond);
+        pthread_mutex_destroy(&lookup->mutex);
+        delete lookup;
+    }
+}
+
+void* UserPrefetch::Thread(void* data) {
+    Job* job = static_cast<Job*>(data);
+    Lookup(job);
+    Release(job);
+    return NULL;
+}
+
+void UserPrefetch::Lookup(Job* lookup) {
+    long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+    lookup->buffer.resize(size > 0 ? size : 16384);
+
+    pthread_mutex_lock(&nss_mutex);
+    nss_lookups++;
+    pthread_mutex_unlock(&nss_mutex);
+
+    struct passwd* result = NULL;
+    while (getpwnam_r(lookup->name.c_str(), &lookup->pw, &lookup->buffer[0],
+                      lookup->buffer.size(), &result) == ERANGE)
+        lookup->buffer.resize(lookup->buffer.size() * 2);
+
+    pthread_mutex_lock(&nss_mutex);
+    nss_lookups--;
+    pthread_mutex_unlock(&nss_mutex);
+
+    // The entry is ready: Get() need not wait for the read-ahead
+    pthread_mutex_lock(&lookup->mutex);
+    lookup->found = (result != NULL);
+    lookup->looked_up = true;
+    pthread_cond_broadcast(&lookup->cond);
+    pthread_mutex_unlock(&lookup->mutex);
+    if (!result)
+        return;
+
+    // Bring the home directory in (automount, network filesystems)
+    const struct passwd& pw = lookup->pw;
+    struct stat st;
+    stat(pw.pw_dir, &st);
+
+    if (pw.pw_shell[0] != '\0')
+        ReadAhead(pw.pw_shell);
+    ReadAhead(string(pw.pw_dir) + "/.xinitrc");
+    if (!lookup->session_cmd.empty())
+        ReadAhead(FindProgram(lookup->session_cmd, lookup->search_path));
+}
+
+/* Have the kernel read file into the page cache, without waiting for
+ * it. The paths come from the user, only regular files are opened:
+ * opening a FIFO or a device could block the thread for good.
+ */
+void UserPrefetch::ReadAhead(const string& file) {
+    struct stat st;
+    if (file.empty() || stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    int fd = open(file.c_str(), O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    // it may have been swapped for something else since the stat()
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+// The executable the first word of command runs, looked up in path
+string UserPrefetch::FindProgram(const string& command, const string& path) {
+    string program = command.substr(0, command.find_first_of(" \t"));
+    if (program.empty() || program.find('/') != string::npos)
+        return program;
+
+    string::size_type start = 0;
+    while (start <= path.length()) {
+        string::size_type end = path.find(':', start);
+        if (end == string::npos)
+            end = path.length();
+        string file = path.substr(start, end - start) + "/" + program;
+        if (end > start && access(file.c_str(), X_OK) == 0)
+            return file;
+        start = end + 1;
+    }
+    return "";
+}
@@ -0,0 +1,54 @@
+/* SLiM - Simple Login Manager
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+*/
+
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <pwd.h>
+#include <string>
+
+/*
+ * Looks a user up while the password is still being typed: resolves
+ * the passwd entry (which may go over the network through NSS), stats
+ * the home directory and has the kernel read ahead the shell,
+ * ~/.xinitrc and the session program, so a successful login finds
+ * them ready. The lookup runs on a detached thread that is never
+ * joined: a lookup that got stuck is simply left behind.
+ */
+class UserPrefetch {
+public:
+    UserPrefetch();
+    ~UserPrefetch();
+
+    // session is the program the session runs, searched for in path
+    void Start(const std::string& user, const std::string& session,
+               const std::string& path);
+    // The passwd entry of user, or NULL if it was not prefetched
+    struct passwd* Get(const std::string& user);
+    void Discard();
+    // No lookup thread is inside NSS: safe to fork a child that uses it
+    static bool Idle();
+
+private:
+    UserPrefetch(const UserPrefetch&);
+    UserPrefetch& operator=(const UserPrefetch&);
+
+    struct Job;
+
+    static void* Thread(void* data);
+    static void Lookup(Job* lookup);
+    static void Release(Job* lookup);
+
+    static void ReadAhead(const std::string& file);
+    static std::string FindProgram(const std::string& command,
+                                   const std::string& path);
+
+    Job* job;   // current lookup, shared with its thread
+};
+
+#endif
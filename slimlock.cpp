@@ -18,7 +18,6 @@
 #include <X11/Xutil.h>
 #include <X11/extensions/dpms.h>
 #include <security/pam_appl.h>
-#include <pthread.h>
 #include <err.h>
 #include <signal.h>
 #include <sys/types.h>
@@ -27,10 +26,15 @@
 #include <errno.h>
 #include <sys/file.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "cfg.h"
 #include "util.h"
 #include "panel.h"
+#include "authworker.h"
 
 #undef APPNAME
 #define APPNAME "slimlock"
@@ -45,7 +49,13 @@ static int ConvCallback(int num_msgs, const struct pam_message **msg,
 						struct pam_response **resp, void *appdata_ptr);
 string findValidRandomTheme(const string& set);
 void HandleSignal(int sig);
-void *RaiseWindow(void *data);
+void LockScreen(int client);
+void RequestLock(int sig);
+int WaitForLockRequest();
+string SocketPath();
+bool PeerIsUs(int fd);
+int ListenSocket();
+int LockThroughDaemon(bool latency);
 
 // I really didn't wanna put these globals here, but it's the only way...
 Display* dpy;
@@ -60,7 +70,10 @@ struct pam_conv conv = {ConvCallback, NULL};
 
 CARD16 dpms_standby, dpms_suspend, dpms_off, dpms_level;
 BOOL dpms_state, using_dpms;
-int term;
+int term = -1;
+unsigned int cfg_passwd_timeout;
+volatile sig_atomic_t lock_requested = 0;
+int listen_fd = -1;
 
 static void
 die(const char *errstr, ...) {
@@ -73,10 +86,25 @@ die(const char *errstr, ...) {
 }
 
 int main(int argc, char **argv) {
+	bool resident = false;
+	bool latency = false;
 	if((argc == 2) && !strcmp("-v", argv[1]))
 		die(APPNAME"-"VERSION", © 2010-2012 Joel Burget\n");
+	else if((argc == 2) && !strcmp("--daemon", argv[1]))
+		resident = true;
+	else if((argc == 2) && !strcmp("--latency", argv[1]))
+		latency = true;
 	else if(argc != 1)
-		die("usage: "APPNAME" [-v]\n");
+		die("usage: "APPNAME" [-v] [--daemon | --latency]\n");
+
+	// Let a running daemon lock the screen: it has everything prepared
+	if (!resident) {
+		int status = LockThroughDaemon(latency);
+		if (status >= 0)
+			return status;
+		if (latency)
+			die(APPNAME": no daemon running\n");
+	}
 
 	void (*prev_fn)(int);
 
@@ -84,6 +112,11 @@ int main(int argc, char **argv) {
 	prev_fn = signal(SIGTERM, HandleSignal);
 	if (prev_fn == SIG_IGN) signal(SIGTERM, SIG_IGN);
 
+	// in resident mode SIGUSR1 locks the screen, and so do requests on
+	// the socket
+	if (resident)
+		signal(SIGUSR1, RequestLock);
+
 	// create a lock file to solve mutliple instances problem
 	// /var/lock used to be the place to put this, now it's /run/lock
 	// ...i think
@@ -103,7 +136,12 @@ int main(int argc, char **argv) {
 			die(APPNAME" already running\n");
 	}
 
-	unsigned int cfg_passwd_timeout;
+	// Listen before getting ready, requests arriving meanwhile are
+	// served as soon as the frame is rendered
+	if (resident && (listen_fd = ListenSocket()) < 0)
+		die(APPNAME": cannot listen on %s: %s\n", SocketPath().c_str(),
+			strerror(errno));
+
 	// Read user's current theme
 	cfg = new Cfg;
 	cfg->readConf(CFGFILE);
@@ -142,8 +180,6 @@ int main(int argc, char **argv) {
 	if (!display) {
 		display = DISPLAY;
 	}
-	XInitThreads();
-
 	if(!(dpy = XOpenDisplay(display)))
 		die(APPNAME": cannot open display\n");
 	scr = DefaultScreen(dpy);
@@ -151,7 +187,8 @@ int main(int argc, char **argv) {
 	XSetWindowAttributes wa;
 	wa.override_redirect = 1;
 
-	// Create a full screen window
+	// Create a full screen window. It is only mapped once the lock
+	// frame is laid out.
 	root = RootWindow(dpy, scr);
 	win = XCreateWindow(dpy,
 	  root,
@@ -165,16 +202,7 @@ int main(int argc, char **argv) {
 	  DefaultVisual(dpy, scr),
 	  CWOverrideRedirect,
 	  &wa);
-	XMapWindow(dpy, win);
-
-	XFlush(dpy);
-	for (int len = 1000; len; len--) {
-		if(XGrabKeyboard(dpy, root, True, GrabModeAsync, GrabModeAsync, CurrentTime)
-			== GrabSuccess)
-			break;
-		usleep(1000);
-	}
-	XSelectInput(dpy, win, ExposureMask | KeyPressMask);
+	XSelectInput(dpy, win, ExposureMask | KeyPressMask | VisibilityChangeMask);
 
 	// This hides the cursor if the user has that option enabled in their
 	// configuration
@@ -187,6 +215,57 @@ int main(int argc, char **argv) {
 	if (ret != PAM_SUCCESS)
 		die("PAM: %s\n", pam_strerror(pam_handle, ret));
 
+	// Get password timeout
+	cfg_passwd_timeout = Cfg::string2int(cfg->getOption("wrong_passwd_timeout").c_str());
+	// Let's just make sure it has a sane value
+	cfg_passwd_timeout = cfg_passwd_timeout > 60 ? 60 : cfg_passwd_timeout;
+
+	if (resident) {
+		// Keep the frame ready and lock whenever we are asked to
+		while (true) {
+			LockScreen(WaitForLockRequest());
+			loginPanel->ResetPasswd();
+		}
+	}
+
+	LockScreen(-1);
+
+	loginPanel->ClosePanel();
+	delete loginPanel;
+
+	Image::forgetDisplay(dpy);
+	XCloseDisplay(dpy);
+
+	flock(lock_file, LOCK_UN);
+	close(lock_file);
+
+	return 0;
+}
+
+/* Show the prepared frame and take the keyboard, then authenticate until
+ * the user unlocks. The window background already holds the lock frame,
+ * so the screen is covered as soon as the server handles the map.
+ * A requesting client is told "locked" once the grab is in place, which
+ * can be later while another client holds the keyboard, and "unlocked"
+ * at the end.
+ */
+// Grab handler: the keyboard is ours, tell the client waiting for it
+static void ReportLocked(void* data)
+{
+	send(*(int*) data, "locked\n", 7, MSG_NOSIGNAL);
+}
+
+void LockScreen(int client)
+{
+	XMapRaised(dpy, win);
+	if (client >= 0)
+		loginPanel->SetGrabHandler(ReportLocked, &client);
+	for (int len = 1000; len; len--) {
+		if (loginPanel->GrabKeyboard())
+			break;
+		usleep(1000);
+	}
+
 	// disable tty switching
 	if(cfg->getOption("tty_lock") == "1") {
 		if ((term = open("/dev/console", O_RDWR)) == -1)
@@ -212,13 +291,9 @@ int main(int argc, char **argv) {
 			DPMSEnable(dpy);
 	}
 
-	// Get password timeout
-	cfg_passwd_timeout = Cfg::string2int(cfg->getOption("wrong_passwd_timeout").c_str());
-	// Let's just make sure it has a sane value
-	cfg_passwd_timeout = cfg_passwd_timeout > 60 ? 60 : cfg_passwd_timeout;
-
-	pthread_t raise_thread;
-	pthread_create(&raise_thread, NULL, RaiseWindow, NULL);
+	// Hear about windows appearing or moving above ours and about the
+	// keyboard grab being lost; the panel raises and grabs again
+	XSelectInput(dpy, root, SubstructureNotifyMask | FocusChangeMask);
 
 	// Main loop
 	while (true)
@@ -232,11 +307,9 @@ int main(int argc, char **argv) {
 		loginPanel->WrongPassword(cfg_passwd_timeout);
 	}
 
-	// kill thread before destroying the window that it's supposed to be raising
-	pthread_cancel(raise_thread);
-
-	loginPanel->ClosePanel();
-	delete loginPanel;
+	XSelectInput(dpy, root, NoEventMask);
+	loginPanel->UngrabKeyboard();
+	XUnmapWindow(dpy, win);
 
 	// Get DPMS stuff back to normal
 	if (using_dpms) {
@@ -244,12 +317,9 @@ int main(int argc, char **argv) {
 		// turn off DPMS if it was off when we entered
 		if (!dpms_state)
 			DPMSDisable(dpy);
+		using_dpms = false;
 	}
-
-	XCloseDisplay(dpy);
-
-	flock(lock_file, LOCK_UN);
-	close(lock_file);
+	XFlush(dpy);
 
 	if(cfg->getOption("tty_lock") == "1") {
 		if ((ioctl(term, VT_UNLOCKSWITCH)) == -1) {
@@ -257,8 +327,225 @@ int main(int argc, char **argv) {
 		}
 	}
 	close(term);
+	term = -1;
 
-	return 0;
+	if (client >= 0) {
+		send(client, "unlocked\n", 9, MSG_NOSIGNAL);
+		close(client);
+	}
+	// Requests which came in while we were locked are moot now
+	if (listen_fd >= 0) {
+		int fd;
+		while ((fd = accept(listen_fd, NULL, NULL)) >= 0)
+			close(fd);
+	}
+	lock_requested = 0;
+}
+
+void RequestLock(int sig)
+{
+	lock_requested = 1;
+}
+
+/* Resident mode: sleep until SIGUSR1 or a client asks for a lock,
+ * meanwhile keeping up with monitor changes so the frame is right when
+ * it is shown. Returns the requesting client, or -1 for SIGUSR1.
+ */
+int WaitForLockRequest()
+{
+	sigset_t block, orig;
+	sigemptyset(&block);
+	sigaddset(&block, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &block, &orig);
+
+	struct pollfd pfd[2];
+	pfd[0].fd = ConnectionNumber(dpy);
+	pfd[0].events = POLLIN;
+	pfd[1].fd = listen_fd;
+	pfd[1].events = POLLIN;
+	int client = -1;
+	while (!lock_requested && client < 0) {
+		loginPanel->ProcessEvents();
+		// SIGUSR1 is only let through while we sleep here
+		pfd[1].revents = 0;
+		if (ppoll(pfd, 2, NULL, &orig) <= 0 || !(pfd[1].revents & POLLIN))
+			continue;
+
+		int fd = accept(listen_fd, NULL, NULL);
+		if (fd < 0)
+			continue;
+		if (!PeerIsUs(fd)) {
+			close(fd);
+			continue;
+		}
+		char request[16];
+		struct timeval tv = { 1, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+		if (n >= 4 && !strncmp(request, "lock", 4))
+			client = fd;
+		else
+			close(fd);
+	}
+	lock_requested = 0;
+
+	sigprocmask(SIG_SETMASK, &orig, NULL);
+	return client;
+}
+
+// Where the daemon listens: one socket per user and display
+string SocketPath()
+{
+	const char* dir = getenv("XDG_RUNTIME_DIR");
+	const char* display = getenv("DISPLAY");
+	return string(dir ? dir : "/tmp") + "/"APPNAME"-"
+		+ (display ? display : DISPLAY);
+}
+
+/* Whether the other end of a connected socket runs as our user. Without
+ * XDG_RUNTIME_DIR the socket lives in /tmp, where anybody could put one.
+ */
+bool PeerIsUs(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+		&& cred.uid == getuid();
+}
+
+/* The socket passed by systemd socket activation, -1 if there is none
+ * meant for us, or fd 3 isn't a listening AF_UNIX stream socket. The
+ * variables are dropped either way, as sd_listen_fds(1) does, so that
+ * children don't take the socket for theirs.
+ */
+static int ActivatedSocket()
+{
+	const char* pid = getenv("LISTEN_PID");
+	const char* fds = getenv("LISTEN_FDS");
+	bool passed = pid && fds && atoi(pid) == getpid() && atoi(fds) >= 1;
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	if (!passed)
+		return -1;
+
+	int fd = 3; // SD_LISTEN_FDS_START
+	int type = 0, listening = 0;
+	socklen_t len = sizeof(type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0
+		|| type != SOCK_STREAM)
+		return -1;
+	len = sizeof(listening);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0
+		|| !listening)
+		return -1;
+	struct sockaddr_storage addr;
+	len = sizeof(addr);
+	if (getsockname(fd, (struct sockaddr*)&addr, &len) < 0
+		|| addr.ss_family != AF_UNIX)
+		return -1;
+	return fd;
+}
+
+/* The daemon's listening socket: the one passed by systemd socket
+ * activation (LISTEN_FDS), or our own one at SocketPath().
+ */
+int ListenSocket()
+{
+	int fd = ActivatedSocket();
+	if (fd < 0) {
+		string path = SocketPath();
+		struct sockaddr_un addr;
+		if (path.length() >= sizeof(addr.sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, path.c_str());
+
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		// we hold the lock file, so a socket of ours left there is stale;
+		// anything else is not ours to remove
+		struct stat st;
+		if (lstat(path.c_str(), &st) == 0) {
+			if (!S_ISSOCK(st.st_mode) || st.st_uid != getuid()) {
+				close(fd);
+				errno = EEXIST;
+				return -1;
+			}
+			unlink(path.c_str());
+		}
+		mode_t mask = umask(0077);
+		int ret = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+		umask(mask);
+		if (ret < 0 || listen(fd, 4) < 0) {
+			close(fd);
+			return -1;
+		}
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+/* Client side: have a running daemon lock the screen and wait until it
+ * is unlocked again, like a standalone slimlock would. With latency set
+ * the time from the request to the keyboard grab is printed. Returns -1
+ * if there is no daemon, otherwise the exit status.
+ */
+int LockThroughDaemon(bool latency)
+{
+	string path = SocketPath();
+	struct sockaddr_un addr;
+	if (path.length() >= sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path.c_str());
+
+	struct timespec start, locked;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	// only a daemon of our own is trusted to say the screen got locked
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+		|| !PeerIsUs(fd)
+		|| send(fd, "lock\n", 5, MSG_NOSIGNAL) != 5) {
+		close(fd);
+		return -1;
+	}
+
+	string reply;
+	char buffer[32];
+	ssize_t n;
+	bool grabbed = false;
+	while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0
+		   || (n < 0 && errno == EINTR)) {
+		if (n < 0)
+			continue;
+		reply.append(buffer, n);
+		if (!grabbed && reply.find("locked\n") == 0) {
+			grabbed = true;
+			clock_gettime(CLOCK_MONOTONIC, &locked);
+			if (latency) {
+				printf(APPNAME": locked %.2f ms after the request\n",
+					   (locked.tv_sec - start.tv_sec) * 1000.0
+					   + (locked.tv_nsec - start.tv_nsec) / 1000000.0);
+				fflush(stdout);
+			}
+		}
+		if (reply.find("unlocked\n") != string::npos)
+			break;
+	}
+	close(fd);
+
+	// the daemon drops requests made while the screen was locked already
+	return grabbed && reply.find("unlocked\n") != string::npos
+		? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 void HideCursor()
@@ -280,10 +567,17 @@ void HideCursor()
 	}
 }
 
+// Run by the UI thread on behalf of the PAM conversation
+static void PromptPasswd(void* data)
+{
+	loginPanel->EventHandler(Panel::Get_Passwd);
+}
+
+// Called on the AuthWorker thread while pam_authenticate runs
 static int ConvCallback(int num_msgs, const struct pam_message **msg,
 						struct pam_response **resp, void *appdata_ptr)
 {
-	loginPanel->EventHandler(Panel::Get_Passwd);
+	AuthWorker::Call(PromptPasswd, NULL);
 
 	// PAM expects an array of responses, one for each message
 	if (num_msgs == 0 ||
@@ -306,9 +600,18 @@ static int ConvCallback(int num_msgs, const struct pam_message **msg,
 	return PAM_SUCCESS;
 }
 
+static void Authenticate(void* result)
+{
+	*static_cast<int*>(result) = pam_authenticate(pam_handle, 0);
+}
+
+// Authenticate on a worker thread, so the lock screen stays responsive
 bool AuthenticateUser()
 {
-	return(pam_authenticate(pam_handle, 0) == PAM_SUCCESS);
+	int result = PAM_AUTH_ERR;
+	AuthWorker worker(loginPanel);
+	worker.Run(Authenticate, &result);
+	return(result == PAM_SUCCESS);
 }
 
 string findValidRandomTheme(const string& set)
@@ -321,8 +624,6 @@ string findValidRandomTheme(const string& set)
 		name.erase(name.length() - 1);
 	}
 
-	Util::srandom(Util::makeseed());
-
 	vector<string> themes;
 	string themefile;
 	Cfg::split(themes, name, ',');
@@ -361,15 +662,3 @@ void HandleSignal(int sig)
 
 	die(APPNAME": Caught signal; dying\n");
 }
-
-// i think this should be in an event loop instead of this threaded
-// thing
-void* RaiseWindow(void *data) {
-	while(1) {
-		XRaiseWindow(dpy, win);
-		XGrabKeyboard(dpy, root, True, GrabModeAsync, GrabModeAsync, CurrentTime);
-		sleep(1);
-	}
-
-	return (void *)0;
-}
@@ -28,12 +28,20 @@ SwitchUser::~SwitchUser() {
     // Never called
 }
 
+// mcookie is NULL if the Xauthority was written by WriteClientAuth()
 void SwitchUser::Login(const char* cmd, const char* mcookie) {
     SetUserId();
-    SetClientAuth(mcookie);
+    if (mcookie)
+        SetClientAuth(mcookie);
     Execute(cmd);
 }
 
+// Write the user's Xauthority as the user, from a process of its own
+bool SwitchUser::WriteClientAuth(const char* mcookie) {
+    SetUserId();
+    return SetClientAuth(mcookie);
+}
+
 void SwitchUser::SetUserId() {
     if( (Pw == 0) ||
             (initgroups(Pw->pw_name, Pw->pw_gid) != 0) ||
@@ -50,11 +58,9 @@ void SwitchUser::Execute(const char* cmd) {
     logStream << APPNAME << ": could not execute login command" << endl;
 }
 
-void SwitchUser::SetClientAuth(const char* mcookie) {
-    bool r;
+bool SwitchUser::SetClientAuth(const char* mcookie) {
     string home = string(Pw->pw_dir);
     string authfile = home + "/.Xauthority";
     remove(authfile.c_str());
-    r = Util::add_mcookie(mcookie, ":0", cfg->getOption("xauth_path"),
-      authfile);
+    return Util::add_mcookie(mcookie, ":0", authfile);
 }
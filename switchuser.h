@@ -30,13 +30,14 @@ public:
                char** _env);
     ~SwitchUser();
     void Login(const char* cmd, const char* mcookie);
+    bool WriteClientAuth(const char* mcookie);
 
 private:
     SwitchUser();
     void SetEnvironment();
     void SetUserId();
     void Execute(const char* cmd);
-    void SetClientAuth(const char* mcookie);
+    bool SetClientAuth(const char* mcookie);
     Cfg* cfg;
     struct passwd *Pw;
 
@@ -9,61 +9,245 @@
 
 #include <sys/types.h>
 
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <X11/Xauth.h>
+
 #include "util.h"
 
 /*
  * Adds the given cookie to the specified Xauthority file.
+ * The file is written in-process with libXau: existing records for the
+ * same local display are carried over except the one being replaced,
+ * and the result is written to a temporary file which is then renamed
+ * over the old one, so a reader never sees a half-written file.
  * Returns true on success, false on fault.
  */
 bool Util::add_mcookie(const std::string &mcookie, const char *display,
-    const std::string &xauth_cmd, const std::string &authfile)
+    const std::string &authfile)
 {
-	FILE *fp;
-	std::string cmd = xauth_cmd + " -f " + authfile + " -q";
+	static const char *authname = "MIT-MAGIC-COOKIE-1";
+	char hostname[256];
+	char cookie[MCOOKIE_BYTES_MAX];
+	std::string number, tmpfile;
+	FILE *in, *out;
+	Xauth *entry, auth;
+	const char *p;
+	int fd, len;
+	bool ok = true;
+
+	/* ":0.0" -> display number "0" */
+	if ((p = strrchr(display, ':')) == NULL)
+		return false;
+	for (p++; *p != '\0' && *p != '.'; p++)
+		number += *p;
+
+	if (gethostname(hostname, sizeof(hostname)) != 0)
+		return false;
+	hostname[sizeof(hostname) - 1] = '\0';
+
+	len = hex2bin(mcookie, cookie, sizeof(cookie));
+	if (len <= 0)
+		return false;
+
+	auth.family = FamilyLocal;
+	auth.address = hostname;
+	auth.address_length = strlen(hostname);
+	auth.number = const_cast<char *>(number.c_str());
+	auth.number_length = number.length();
+	auth.name = const_cast<char *>(authname);
+	auth.name_length = strlen(authname);
+	auth.data = cookie;
+	auth.data_length = len;
+
+	if (XauLockAuth(authfile.c_str(), 3, 1, 0) != LOCK_SUCCESS)
+		return false;
 
-	fp = popen(cmd.c_str(), "w");
-	if (!fp)
+	tmpfile = authfile + "-n";
+	fd = open(tmpfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || (out = fdopen(fd, "wb")) == NULL) {
+		if (fd >= 0)
+			close(fd);
+		XauUnlockAuth(authfile.c_str());
 		return false;
-	fprintf(fp, "remove %s\n", display);
-	fprintf(fp, "add %s %s %s\n", display, ".", mcookie.c_str());
-	fprintf(fp, "exit\n");
+	}
+
+	/* "remove" step: keep every record but the one for this display */
+	if ((in = fopen(authfile.c_str(), "rb")) != NULL) {
+		while (ok && (entry = XauReadAuth(in)) != NULL) {
+			bool same = entry->family == auth.family
+			    && entry->address_length == auth.address_length
+			    && !memcmp(entry->address, auth.address,
+				auth.address_length)
+			    && entry->number_length == auth.number_length
+			    && !memcmp(entry->number, auth.number,
+				auth.number_length);
+			if (!same)
+				ok = XauWriteAuth(out, entry) != 0;
+			XauDisposeAuth(entry);
+		}
+		fclose(in);
+	}
+
+	/* "add" step */
+	if (ok)
+		ok = XauWriteAuth(out, &auth) != 0;
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0)
+		ok = false;
+	if (fclose(out) != 0)
+		ok = false;
 
-	pclose(fp);
-	return true;
+	if (ok && rename(tmpfile.c_str(), authfile.c_str()) != 0)
+		ok = false;
+	if (!ok)
+		unlink(tmpfile.c_str());
+
+	XauUnlockAuth(authfile.c_str());
+	memset(cookie, 0, sizeof(cookie));
+	return ok;
+}
+
+static int hexval(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
 }
 
 /*
- * Interface for random number generator.  Just now it uses ordinary
- * random/srandom routines and serves as a wrapper for them.
+ * Decodes a string of hex digits into raw bytes.
+ * Returns the number of bytes written, or -1 on malformed input.
  */
-void Util::srandom(unsigned long seed)
+int Util::hex2bin(const std::string &hex, char *buf, size_t size)
 {
-	::srandom(seed);
+	size_t i, n = hex.length() / 2;
+
+	if (hex.length() % 2 != 0 || n > size)
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		int hi = hexval(hex[2 * i]);
+		int lo = hexval(hex[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return -1;
+		buf[i] = (char)((hi << 4) | lo);
+	}
+	return (int)n;
 }
 
+/*
+ * Fills buf with len bytes from the kernel CSPRNG.  Uses a single
+ * getrandom(2) call where available and /dev/urandom otherwise.
+ * Returns true on success, false on fault.
+ */
+bool Util::getrandom(void *buf, size_t len)
+{
+	unsigned char *p = static_cast<unsigned char *>(buf);
+	ssize_t n;
+
+#ifdef HAVE_GETRANDOM
+	while (len > 0) {
+		n = ::getrandom(p, len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		p += n;
+		len -= n;
+	}
+	if (len == 0)
+		return true;
+#endif
+
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		p += n;
+		len -= n;
+	}
+	close(fd);
+	return len == 0;
+}
+
+/*
+ * Interface for random number generator.  Values are taken from a
+ * small pool refilled from getrandom(), so no global seeding is needed
+ * and most calls don't enter the kernel at all.  Should the kernel fail
+ * us, random(3) takes over, seeded once from the time and pid so that
+ * it doesn't repeat the same sequence on every boot.  Not for secrets:
+ * the auth cookie comes from getrandom() and is never made without it.
+ */
 long Util::random(void)
 {
-	return ::random();
+	static unsigned char pool[128];
+	static size_t avail = 0;
+	static bool seeded = false;
+	unsigned long value;
+
+	if (avail < sizeof(value)) {
+		if (!Util::getrandom(pool, sizeof(pool))) {
+			if (!seeded) {
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				srandom((unsigned int)(ts.tv_sec ^ ts.tv_nsec
+				    ^ ((unsigned long)getpid() << 16)));
+				seeded = true;
+			}
+			return ::random();
+		}
+		avail = sizeof(pool);
+	}
+	avail -= sizeof(value);
+	memcpy(&value, pool + avail, sizeof(value));
+	memset(pool + avail, 0, sizeof(value));
+
+	return (long)(value & LONG_MAX);
 }
 
 /*
- * Makes seed for the srandom() using "random" values obtained from
- * getpid(), time(NULL) and others.
+ * Encodes len bytes as lowercase hex.  Each byte maps to a precomputed
+ * pair of digits, so the loop is a plain table lookup per byte.
  */
-long Util::makeseed(void)
+std::string Util::bin2hex(const unsigned char *buf, size_t len)
 {
-	struct timespec ts;
-	long pid = getpid();
-	long tm = time(NULL);
+	static char table[256][2];
+	static bool ready = false;
+	const char *digits = "0123456789abcdef";
+	std::string hex(2 * len, '0');
 
-	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
-		ts.tv_sec = ts.tv_nsec = 0;
+	if (!ready) {
+		for (int i = 0; i < 256; i++) {
+			table[i][0] = digits[i >> 4];
+			table[i][1] = digits[i & 0x0f];
+		}
+		ready = true;
 	}
 
-	return pid + tm + (ts.tv_sec ^ ts.tv_nsec);
+	for (size_t i = 0; i < len; i++) {
+		hex[2 * i] = table[buf[i]][0];
+		hex[2 * i + 1] = table[buf[i]][1];
+	}
+	return hex;
 }
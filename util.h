@@ -9,16 +9,22 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <stddef.h>
 #include <string>
 
+/* Largest cookie (in bytes) add_mcookie() will accept */
+#define MCOOKIE_BYTES_MAX 64
+
 namespace Util {
 	bool add_mcookie(const std::string &mcookie, const char *display,
-	    const std::string &xauth_cmd, const std::string &authfile);
+	    const std::string &authfile);
+
+	int hex2bin(const std::string &hex, char *buf, size_t size);
 
-	void srandom(unsigned long seed);
+	bool getrandom(void *buf, size_t len);
 	long random(void);
 
-	long makeseed(void);
+	std::string bin2hex(const unsigned char *buf, size_t len);
 };
 
 #endif /* __UTIL_H__ */